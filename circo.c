@@ -3,7 +3,9 @@
  * circo is an IRC client...
  *
  * The messages handlers are organized in an array which is accessed whenever a
- * new message has been fetched. This allows message dispatching in O(1) time.
+ * new message has been fetched. At startup msgindex() indexes it by numeric
+ * code and by a perfect hash of the other commands, which allows message
+ * dispatching in O(1) time.
  *
  * Keys are organized as arrays and defined in config.h.
  *
@@ -13,31 +15,52 @@
 #define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
-#include <wchar.h>
 
 #include "arg.h"
+#include "width.h"
 char *argv0;
 
 /* macros */
 #define LENGTH(X)       (sizeof X / sizeof X[0])
-#define ISCHANPFX(P)    ((P) == '#' || (P) == '&')
-#define ISCHAN(B)       ISCHANPFX((B)->name[0])
+#define BUFSEG          65536 /* bytes per segment of buffer text */
+#define CASEMAP(C,M)    ((C) >= 'A' && (C) <= ((M) == CaseAscii ? 'Z' : ']') ? (C) + 32 \
+			: (M) == CaseRfc1459 && (C) == '~' ? '^' : (C))
+#define BUFPTR(B,O)     ((B)->segs[(O) / BUFSEG].data ? &(B)->segs[(O) / BUFSEG].data[(O) % BUFSEG] : bufload(B, O))
+#define CELLDIFF(A,B)   ((A)->attr != (B)->attr || strcmp((A)->g, (B)->g))
+#define NICKSLAB(S)     (!(S) ? 64 : (S)->size < 4096 ? (S)->size * 2 : 4096) /* next slab size */
+#define WHEELBITS       6 /* slots of each level of the timer wheel, as a power of two */
+#define WHEELSZ         (1 << WHEELBITS)
+#define WHEELLVLS       4 /* 64^4 ms, about four and a half hours */
+#define SLOT(T,L)       ((T) >> (WHEELBITS * (L)) & (WHEELSZ - 1))
+#define LOGFILES        32 /* log files kept open by logwrite() */
+#define STOREFILES      32 /* scrollback stores kept open, see storefiles() */
+#define ARCBLOOM        1024 /* bits of the nick filter of an archive block */
 
 /* UTF-8 utils */
 #define UTF8BYTES(X)    ( ((X) & 0xF0) == 0xF0 ? 4 \
@@ -54,11 +77,12 @@ char *argv0;
 
 /* VT100 escape sequences */
 #define CLEAR           "\33[2J"
-#define CLEARLN         "\33[2K"
-#define CLEARRIGHT      "\33[0K"
 #define CURPOS          "\33[%d;%dH"
+#define CURFWD          "\33[%dC"
 #define CURSON          "\33[?25h"
 #define CURSOFF         "\33[?25l"
+#define SCROLLREG       "\33[%d;%dr"
+#define SCROLLRST       "\33[r"
 /* colors */
 #define COLFG           "\33[38;5;%dm"
 #define COLBG           "\33[48;5;%dm"
@@ -83,8 +107,10 @@ char *argv0;
 #define CTRL_ALT(k) ((k) + (129 - 'a'))
 
 /* enums */
-enum { KeyFirst = -999, KeyUp, KeyDown, KeyRight, KeyLeft, KeyHome, KeyEnd, KeyDel, KeyPgUp, KeyPgDw, KeyBackspace, KeyLast };
+enum { KeyFirst = -999, KeyUp, KeyDown, KeyRight, KeyLeft, KeyHome, KeyEnd, KeyDel, KeyPgUp, KeyPgDw, KeyBackspace, KeyWinsize, KeyLast };
 enum { LineToOffset, OffsetToLine, TotalLines }; /* bufinfo() flags */
+enum { SendUrgent, SendText, SendBulk, SendLast }; /* sout() priorities */
+enum { CaseAscii, CaseStrict, CaseRfc1459 }; /* ISUPPORT CASEMAPPING */
 
 enum {
 	NickNormal,
@@ -100,29 +126,213 @@ typedef union {
 	const void *v;
 } Arg;
 
+typedef struct Buffer Buffer;
+typedef struct Network Network;
 typedef struct Nick Nick;
-struct Nick {
-	char name[16];
+typedef struct NickSlab NickSlab;
+typedef struct User User;
+
+/* Users are interned in usertab[] and shared by all the channels they are in.
+ * A Nick is the membership of a user in a channel. */
+struct User {
+	char *name;
 	int len;
-	Nick *next;
+	unsigned int id; /* hashed in the channels nametab[] */
+	int refs;
+	Nick *chans;
+	User *hnext; /* in usertab[] */
 };
 
-typedef struct Buffer Buffer;
-struct Buffer {
+struct Nick {
+	User *user;
+	Buffer *buf;
+	Nick *next, *prev; /* in the channel names */
+	Nick *hnext; /* in the channel nametab[] */
+	Nick *unext; /* in the user chans */
+};
+
+/* Nicks of a channel are carved from its slabs and all released at once by
+ * freenames(), nickdel() only puts them in the channel free list. */
+struct NickSlab {
+	NickSlab *next;
+	int size, used;
+	Nick nicks[];
+};
+
+/* A segment of buffer text, len bytes long. Old segments may get compressed
+ * (data is NULL and z holds zlen bytes) or dropped (both are NULL), see
+ * memtrim(). Mapped segments point in the scrollback store, see storeopen(). */
+typedef struct {
 	char *data;
+	char *z;
+	int len, zlen;
+	int mapped;
+} Segment;
+
+/* The time of the text of a buffer from off on. Only changes are recorded. */
+typedef struct {
+	int off;
+	time_t t;
+} Stamp;
+
+/* A record of the index of a scrollback store: where a line ends and when it
+ * was received. */
+typedef struct {
+	uint32_t end, t;
+} StoreLine;
+
+/* A line queued by logfmt() for logwrite(): the path of the file and the
+ * text follow, each with a NUL. len is a multiple of 8, 0 marks the end of
+ * the ring. */
+typedef struct {
+	int len, pathlen, textlen;
+	char s[];
+} LogRec;
+
+/* An entry of the index of the log archive, see arcadd(). The block is
+ * stored as it is when zlen equals len, else compressed with lzpack(). */
+typedef struct {
+	int64_t off;
+	uint32_t len, zlen;
+	uint32_t t0, t1; /* time of the first and of the last line */
+	char buf[48]; /* server/buffer the lines were logged for */
+	unsigned char bloom[ARCBLOOM / 8]; /* nicks of the lines, see arcbloom() */
+} ArcBlock;
+
+/* A log file open in logwrite(), the most recently used first. */
+typedef struct LogFile LogFile;
+struct LogFile {
+	LogFile *next;
+	char *path;
+	FILE *fp;
+	long size;
+	time_t since;
+	int dirty;
+};
+
+/* A line waiting to be sent, with its CR LF. */
+typedef struct SendLine SendLine;
+struct SendLine {
+	SendLine *next;
+	int prio, len;
+	char s[];
+};
+
+typedef struct {
+	SendLine *head, *tail;
+	int n, max;
+} SendQueue;
+
+/* A deadline on the timer wheel, prev is NULL unless it is pending. */
+typedef struct Timer Timer;
+struct Timer {
+	void (*func)(void *arg);
+	void *arg;
+	Timer *next, **prev;
+	long long when;
+	int level;
+};
+
+/* A file descriptor in the event loop. */
+typedef struct Watch Watch;
+struct Watch {
+	void (*func)(Watch *w, int events);
+	void *arg;
+	int fd, events;
+};
+
+/* A connection attempt to one of the addresses of the server. */
+typedef struct {
+	Watch w;
+	int family;
+} Attempt;
+
+/* A name lookup, done by resolve() in a thread of its own. */
+typedef struct {
+	Network *net;
+	char host[32], port[8];
+	struct addrinfo *res;
+	int err;
+} Lookup;
+
+/* A server connection with its own identity, buffers and users. The buffers
+ * of all the networks are in one list, their names are looked up by network
+ * in buftab[]. */
+struct Network {
+	Network *next;
+	char host[32], port[8], nick[32];
+	char chantypes[8], prefix[8]; /* ISUPPORT CHANTYPES and PREFIX symbols */
+	int casemap;
+	FILE *srv;
+	int online;
+	int capreq; /* CAP REQ sent, see recv_cap() */
+	time_t trespond;
+	char bufin[16384]; /* received data, bufinlen bytes of it */
+	int bufinlen;
+	SendQueue sendq[SendLast]; /* lines to be sent, by priority */
+	SendLine *sendpart; /* line of which sendoff bytes went out already */
+	int sendoff, sendn;
+	int sendtokens; /* lines which can go out now, see sendrefill() */
+	long long sendlast;
+	unsigned long sentlines, sentbytes, sendstalls;
+	Watch watch;
+	Timer keeptimer, sendtimer, retrytimer, dialtimer;
+	int retrywait; /* seconds before the next reconnection */
+	Lookup *lookup; /* the one in progress, if any */
+	struct addrinfo *dialres, *dialaddr[16]; /* the addresses to try, in order */
+	Attempt dialv[16];
+	int naddrs, dialn, dialing; /* attempts started and still going on */
+	long long dialt0, dnsms;
+	Buffer *status;
+	Buffer **buftab; /* buffers by casehash() of their name */
+	int nbuffers, buftabsz;
+	User **usertab; /* users by casehash() of their name */
+	int nusers, usertabsz;
+	unsigned int userid;
+};
+
+/* The text of a buffer lives in segments of BUFSEG bytes which are never
+ * moved. A write never spans two segments: the rest of a segment which cannot
+ * hold the next one is left to its NUL terminator. Offsets are logical, the
+ * offset O is at BUFPTR(b, O) and len is the offset where to append next.
+ * Segments before segfirst have been dropped. */
+struct Buffer {
+	Segment *segs;
+	int nsegs, segssz, segfirst;
+	long memres, memzip; /* resident and compressed bytes */
+	Stamp *stamps;
+	int nstamps, stampssz;
+	FILE *store, *storeidx; /* scrollback store and its line index, if open */
+	Buffer *snext; /* in stores */
+	int storeon, storedirty; /* b has a store, written since storeflush() */
+	char *logpath; /* see logpath() */
+	char *histpath; /* see histpath() */
+	long storeoff;
+	char *map; /* the store as it was when opened */
+	size_t mapsz;
 	char name[64];
-	char *hist;
+	char *hist; /* ring of histbytes bytes, see histpush() */
+	int *histidx; /* ring of the offsets of histmax entries */
+	int histfirst, histn, histloaded;
 	char cmdbuf[256];
-	int size, len, kicked;
+	int len, kicked;
 	int line, nlines, lnoff;
+	int *lnidx, lnidxsz; /* offsets of line starts, see bufindex() */
+	int lncols, lnscan, lnx;
 	int cmdlen, cmdoff, cmdpos;
-	int histsz, histlnoff;
+	int histlnoff;
 	int need_redraw;
 	int notify;
 	int totnames;
 	int recvnames;
 	Nick *names;
-	Buffer *next;
+	Nick **nametab; /* names by User.id */
+	int nametabsz;
+	NickSlab *slabs;
+	Nick *freenicks;
+	Network *net;
+	Buffer *next, *prev; /* the prev of the first buffer is the last one */
+	Buffer *hnext; /* in the buftab[] of net */
 };
 
 typedef struct {
@@ -130,9 +340,22 @@ typedef struct {
 	void (*func)(char *, char *);
 } Command;
 
+typedef struct {
+	char *s;
+	int len;
+} Str;
+
+/* A message from the server, split in place. Missing fields are empty. */
+typedef struct {
+	Str tags, nick, user, host, cmd;
+	Str par[15];
+	int npar;
+} Msg;
+
 typedef struct {
 	char *name;
-	void (*func)(char *, char *, char *);
+	void (*func)(Network *, Msg *);
+	unsigned long hits;
 } Message;
 
 typedef struct {
@@ -141,18 +364,39 @@ typedef struct {
 	const Arg arg;
 } Key;
 
+typedef struct {
+	char g[8]; /* UTF-8 glyph, empty for the right half of a wide one */
+	int attr; /* index in colors[] or -1 */
+} Cell;
+
 /* function declarations */
+void arcadd(char *path, char *key);
+int arcbloom(unsigned char *bloom, char *nick, int set);
+char *arcnick(char *line, char *nick, int size);
+void arcquery(int argc, char *argv[]);
+time_t arctime(char *s, int end);
 void attach(Buffer *b);
 int bprintf(Buffer *b, char *fmt, ...);
 int bprintf_prefixed(Buffer *b, char *fmt, ...);
-int bufinfo(char *buf, int len, int val, int act);
+void bufindex(Buffer *b);
+int bufinfo(Buffer *b, int val, int act);
+char *bufload(Buffer *b, int off);
+void bufreflow(Buffer *b);
+void bufstamp(Buffer *b, int off, time_t t);
+time_t buftime(Buffer *b, int off);
 int bvprintf(Buffer *b, char *fmt, va_list ap);
+int casecmp(Network *n, char *a, char *b);
+unsigned int casehash(Network *n, char *s);
 void cleanup(void);
 void cmd_close(char *cmd, char *s);
+void cmd_detach(char *cmd, char *s);
+void cmd_mem(char *cmd, char *s);
 void cmd_msg(char *cmd, char *s);
+void cmd_network(char *cmd, char *s);
 void cmd_quit(char *cmd, char *s);
 void cmd_rejoinall(char *cmd, char *s);
 void cmd_server(char *cmd, char *s);
+void cmd_stats(char *cmd, char *s);
 void cmd_topic(char *cmd, char *s);
 void cmdln_chldel(const Arg *arg);
 void cmdln_chrdel(const Arg *arg);
@@ -161,85 +405,199 @@ void cmdln_complete(const Arg *arg);
 void cmdln_cursor(const Arg *arg);
 void cmdln_submit(const Arg *arg);
 void cmdln_wdel(const Arg *arg);
+int cpwidth(unsigned int cp);
 void detach(Buffer *b);
 void destroy(Buffer *b);
-int dial(char *host, char *port, int flags);
+void dial(Network *n);
+void dialin(Watch *w, int events);
+void dialio(Watch *w, int events);
+void dialnext(void *arg);
+void dialstop(Network *n);
 void die(const char *fmt, ...);
 void draw(void);
 void drawbar(void);
 void drawbuf(void);
 void drawcmdln(void);
+void drawframe(void *arg);
 void *ecalloc(size_t nmemb, size_t size);
-Buffer *getbuf(char *name);
+Buffer *getbuf(Network *n, char *name);
+Message *getmsg(char *cmd);
 void focus(Buffer *b);
 void focusnext(const Arg *arg);
 void focusnum(const Arg *arg);
 void focusprev(const Arg *arg);
 void freebuf(Buffer *b);
-void freenames(Nick **names);
+void freenames(Buffer *b);
+void frontend(void);
 char *gcsfitcols(char *s, int maxw);
 int gcswidth(char *s, int len);
 int getkey(void);
-void hangsup(void);
+void hangsup(Network *n);
+char *histget(Buffer *b, int n);
+char *histpath(Buffer *b);
 void history(const Arg *arg);
-void histpush(char *buf, int len);
-int logfmt(char *fmt, ...);
-int mvprintf(int x, int y, char *fmt, ...);
-Buffer *newbuf(char *name);
+void histload(Buffer *b);
+void histpush(Buffer *b, char *buf, int len, int save);
+int intable(const Interval *t, int n, unsigned int cp);
+int ischan(Network *n, char *s);
+void keepalive(void *arg);
+void lnbegin(void);
+int lncommit(Buffer *b);
+void lnprintf(char *fmt, ...);
+void lnvprintf(char *fmt, va_list ap);
+void logclose(void);
+LogFile *logfile(char *path);
+void logflush(void);
+int logfmt(Buffer *b, char *fmt, ...);
+void logopen(void);
+char *logpath(Buffer *b);
+void logrotate(LogFile *f);
+void *logwrite(void *arg);
+void lsnin(Watch *w, int events);
+int lzpack(char *in, int len, char *out, int size);
+int lzunpack(char *in, int len, char *out, int size);
+void memtrim(void);
+long long mstime(void);
+void msgindex(void);
+Buffer *netbuf(Network *n);
+char *netstate(Network *n);
+Buffer *newbuf(Network *n, char *name);
+Network *newnet(char *h, char *p);
 Nick *nickadd(Buffer *b, char *name);
+Nick *nickalloc(Buffer *b);
 void nickdel(Buffer *b, char *name);
 Nick *nickget(Buffer *b, char *name);
 void nicklist(Buffer *b, char *list);
-void nickmv(char *old, char *new);
+void outprintf(char *fmt, ...);
 void parsecmd(char *cmd);
-void parsesrv(void);
-void privmsg(char *to, char *txt);
-void quit(char *msg);
+void parsesrv(Network *n, char *line);
+int peerok(int fd);
+void privmsg(Network *n, char *to, char *txt);
+void quit(Network *n, char *msg);
 int readchar(void);
-void recv_busynick(char *u, char *u2, char *u3);
-void recv_join(char *who, char *chan, char *txt);
-void recv_kick(char *who, char *chan, char *txt);
-void recv_luserme(char *a, char *b, char *c);
-void recv_mode(char *u, char *val, char *u2);
-void recv_motd(char *u, char *u2, char *txt);
-void recv_names(char *usr, char *par, char *txt);
-void recv_namesend(char *host, char *par, char *names);
-void recv_nick(char *who, char *u, char *txt);
-void recv_notice(char *who, char *u, char *txt);
-void recv_part(char *who, char *chan, char *txt);
-void recv_ping(char *u, char *u2, char *txt);
-void recv_privmsg(char *from, char *to, char *txt);
-void recv_quit(char *who, char *u, char *txt);
-void recv_topic(char *who, char *chan, char *txt);
-void recv_topicrpl(char *usr, char *par, char *txt);
+void reconnect(void *arg);
+void recv_busynick(Network *n, Msg *m);
+void recv_cap(Network *n, Msg *m);
+void recv_isupport(Network *n, Msg *m);
+void recv_join(Network *n, Msg *m);
+void recv_kick(Network *n, Msg *m);
+void recv_luserme(Network *n, Msg *m);
+void recv_mode(Network *n, Msg *m);
+void recv_motd(Network *n, Msg *m);
+void recv_names(Network *n, Msg *m);
+void recv_namesend(Network *n, Msg *m);
+void recv_nick(Network *n, Msg *m);
+void recv_notice(Network *n, Msg *m);
+void recv_part(Network *n, Msg *m);
+void recv_ping(Network *n, Msg *m);
+void recv_privmsg(Network *n, Msg *m);
+void recv_quit(Network *n, Msg *m);
+void recv_topic(Network *n, Msg *m);
+void recv_topicrpl(Network *n, Msg *m);
+void recv_welcome(Network *n, Msg *m);
+void rehash(Network *n);
 void resize(int x, int y);
+void *resolve(void *arg);
+void retry(Network *n);
+void scrclear(int x, int y);
+void scrflush(void);
 void scroll(const Arg *arg);
-void sendident(void);
+int scrput(int x, int y, char *s, int len);
+void scrresize(void);
+void scrscroll(int top, int bot, int n);
+Segment *segadd(Buffer *b, char *data);
+void segdrop(Buffer *b);
+void segzip(Buffer *b, int i);
+void sendflush(Network *n, int force);
+void sendident(Network *n);
+void sendrefill(Network *n);
+void sendwatch(void *arg);
 void setup(void);
-void sigchld(int unused);
-void sigwinch(int unused);
+void sigin(Watch *w, int events);
 char *skip(char *s, char c);
-void sout(char *fmt, ...);
+void sockfind(void);
+void sout(Network *n, int prio, char *fmt, ...);
+void srvin(Network *n);
+void srvio(Watch *w, int events);
 void spawn(const char **cmd);
+void storeclose(Buffer *b);
+int storefiles(Buffer *b);
+void storeflush(void);
+void storemap(Buffer *b, FILE *fp, FILE *ifp);
+void storeopen(Buffer *b);
+char *storepath(Buffer *b, char *dir, char *ext);
+void storeput(Buffer *b, char *s, int len);
 void stripformats(char *s);
+time_t tagtime(Str *tags);
+char *timeprefix(time_t t);
+void timerdel(Timer *t);
+long long timernext(void);
+void timerrun(long long t);
+void timerset(Timer *t, long long when);
+int tokenize(char *s, Msg *m);
+char *token(char *s, Str *t);
 void trim(char *s);
+void ttyraw(void);
 int uiset(char *buf, int index);
 void usage(void);
+User *useradd(Network *n, char *name);
+void userdel(Network *n, User *u);
+User *userget(Network *n, char *name);
+void usermv(Network *n, User *u, char *name);
+void usrdrop(void);
 void usrin(void);
+void usrio(Watch *w, int events);
+int utf8decode(char *s, unsigned int *cp);
+unsigned int vhash(char *s, unsigned int seed);
 char *wordleft(char *str, int offset, int *size);
+void watch(Watch *w, int fd, int events);
 
 /* variables */
-FILE *srv, *logp;
-Buffer *buffers, *status, *sel;
-char bufin[4096];
+char *logq; /* ring of logqueue bytes of LogRec, see logfmt() */
+unsigned long loghead, logtail; /* bytes ever queued and ever written */
+unsigned long logkicked, logdrops, logdropsaid;
+int logfd = -1; /* eventfd(2) waking logwrite() up */
+int logstop;
+pthread_t logthread;
+char logmain[512]; /* the log of what belongs to no buffer */
+LogFile *logfiles; /* owned by logwrite() */
+Buffer *stores; /* with the store files open, the last written first */
+int storedirty; /* some of the stores need storeflush() */
+Network *networks;
+Buffer *buffers, *sel;
+Buffer **bufpos; /* buffers by position, see focusnum() */
+int nbuffers, bufposok;
+long memres, memzip; /* scrollback bytes of all the buffers */
+char *lnbuf; /* line being built, see lnbegin() */
+int lnlen, lnsz;
+int memcheck; /* memtrim() is due */
 char bufout[4096];
 struct termios origti;
-time_t trespond;
+time_t now, msgtime; /* the time of this round of run() and of the message being handled */
 int running = 1;
-int online = 0;
+int daemonize; /* frontends attach through sockpath, see lsnin() */
+char sockpath[sizeof ((struct sockaddr_un *)0)->sun_path]; /* see sockfind() */
+int outfd = 1; /* where the frames go, -1 when nothing is attached */
+int pollfd; /* epoll(7) instance of run() */
+Watch usrwatch = { usrio, NULL, -1 }, sigwatch = { sigin, NULL, -1 };
+Watch lsnwatch = { lsnin, NULL, -1 };
+Timer *wheel[WHEELLVLS][WHEELSZ]; /* pending timers, see timerset() */
+int wheeln[WHEELLVLS];
+long long wheelnow; /* next tick of the wheel to run */
+Timer drawtimer = { drawframe };
+long long drawlast;
+int dnsfd[2]; /* resolve() hands the lookups back through this pipe */
+Watch dnswatch = { dialin, NULL, -1 };
 int rows, cols;
+Cell *curscr, *newscr; /* what the terminal shows and what it should show */
+int drawattr = -1, termattr = -1, termx = -1, termy = -1;
+Buffer *shown; /* last buffer drawn to its bottom, with shownlines lines */
+int shownlines;
+char *out;
+int outlen, outsz;
 
 Message messages[] = {
+	{ "CAP",     recv_cap },
 	{ "JOIN",    recv_join },
 	{ "KICK",    recv_kick },
 	{ "MODE",    recv_mode },
@@ -250,6 +608,8 @@ Message messages[] = {
 	{ "PRIVMSG", recv_privmsg },
 	{ "QUIT",    recv_quit },
 	{ "TOPIC",   recv_topic },
+	{ "001",     recv_welcome },
+	{ "005",     recv_isupport },
 	{ "255",     recv_luserme },
 	{ "331",     recv_topicrpl }, /* no topic set */
 	{ "332",     recv_topicrpl },
@@ -264,15 +624,248 @@ Message messages[] = {
 	{ "470",     NULL }, /* channel forward */
 
 };
+Message *numerics[1000]; /* messages[] by numeric reply */
+Message *verbs[64]; /* messages[] by vhash() of the other commands */
+unsigned int vseed;
+unsigned long unhandled;
 
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
 /* function implementations */
+/* Move the rotated log at path into the archive of logdir, in blocks of
+ * whole lines of at most BUFSEG bytes. Each block is compressed and indexed
+ * with its time range, key (the server and buffer) and the nicks of its
+ * lines. The index entry is written after the block, and the log is removed
+ * once it is all in. Only logwrite() calls it. */
+void
+arcadd(char *path, char *key) {
+	static char z[BUFSEG];
+	char apath[512], ipath[512], head[128], nick[64];
+	struct stat st;
+	ArcBlock ab;
+	FILE *ap, *ip;
+	char *map, *p, *e, *l, *nl;
+	int fd, n, err = 0;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	if(fstat(fd, &st) < 0 || !st.st_size
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	snprintf(apath, sizeof apath, "%s/archive", logdir);
+	snprintf(ipath, sizeof ipath, "%s/archive.idx", logdir);
+	if(!(ap = fopen(apath, "a"))) {
+		munmap(map, st.st_size);
+		return;
+	}
+	if(!(ip = fopen(ipath, "a"))) {
+		fclose(ap);
+		munmap(map, st.st_size);
+		return;
+	}
+	fseek(ap, 0, SEEK_END);
+	for(p = map, e = map + st.st_size; p < e && !err; p = l) {
+		memset(&ab, 0, sizeof ab);
+		strncpy(ab.buf, key, sizeof ab.buf - 1);
+		ab.t0 = ab.t1 = strtoul(p, NULL, 10);
+		for(l = p; l < e && (nl = memchr(l, '\n', e - l)) && nl + 1 - p <= BUFSEG; l = nl + 1) {
+			n = nl - l < sizeof head ? nl - l : sizeof head - 1;
+			memcpy(head, l, n);
+			head[n] = '\0';
+			ab.t1 = strtoul(head, NULL, 10);
+			if(arcnick(head, nick, sizeof nick))
+				arcbloom(ab.bloom, nick, 1);
+		}
+		if(l == p)
+			l = p + (e - p < BUFSEG ? e - p : BUFSEG); /* no whole line fits */
+		ab.off = ftell(ap);
+		ab.len = l - p;
+		n = lzpack(p, ab.len, z, ab.len - 1);
+		ab.zlen = n < 0 ? ab.len : n;
+		if(fwrite(n < 0 ? p : z, 1, ab.zlen, ap) != ab.zlen || fflush(ap)
+		|| fwrite(&ab, sizeof ab, 1, ip) != 1 || fflush(ip))
+			err = 1;
+	}
+	munmap(map, st.st_size);
+	fclose(ap);
+	fclose(ip);
+	if(!err)
+		unlink(path);
+}
+
+/* Add the nick to the filter of an archive block, or tell whether it may
+ * be in there. */
+int
+arcbloom(unsigned char *bloom, char *nick, int set) {
+	unsigned int h = 2166136261u, h2, bit;
+	int i;
+
+	for(; *nick; ++nick)
+		h = (h ^ (unsigned char)*nick) * 16777619u;
+	h2 = (h >> 16 | h << 16) | 1;
+	for(i = 0; i < 3; ++i, h += h2) {
+		bit = h % ARCBLOOM;
+		if(set)
+			bloom[bit / 8] |= 1 << bit % 8;
+		else if(!(bloom[bit / 8] & 1 << bit % 8))
+			return 0;
+	}
+	return 1;
+}
+
+/* Copy the nick a log line is about in nick, casemapped. The lines are
+ * "time VERB nick ...", "time PRIVMSG from nick..." and
+ * "time TOPIC channel (nick): ...", see the calls to logfmt(). */
+char *
+arcnick(char *line, char *nick, int size) {
+	char *p;
+	int n;
+
+	if(!(p = strchr(line, ' ')) || !(p = strchr(p + 1, ' ')))
+		return NULL;
+	++p;
+	if(!strncmp(p, "from ", 5))
+		p += 5;
+	else if(!strncmp(p, "to ", 3))
+		return NULL; /* sent by us */
+	else if(!strncmp(strchr(line, ' ') + 1, "TOPIC ", 6) && !(p = strchr(p, '(')))
+		return NULL;
+	else if(*p == '(')
+		++p;
+	for(n = 0; n < size - 1 && p[n] && !strchr(" :)", p[n]); ++n)
+		nick[n] = CASEMAP((unsigned char)p[n], CaseRfc1459);
+	nick[n] = '\0';
+	return n ? nick : NULL;
+}
+
+/* circo -q: print the archived lines matching all the conditions, given as
+ * buf=, nick=, from= and to=. Only the blocks whose index entry matches get
+ * read and decompressed. */
+void
+arcquery(int argc, char *argv[]) {
+	static char text[BUFSEG], z[BUFSEG];
+	char path[512], head[128], nick[64], tbuf[32], *buf = "", *who = "";
+	char *p, *l, *nl, *e;
+	ArcBlock *idx, *ab;
+	time_t from = 0, to = (time_t)UINT32_MAX, t;
+	struct stat st;
+	int fd, ifd, n, i;
+
+	for(i = 0; i < argc; ++i) {
+		if(!strncmp(argv[i], "buf=", 4))
+			buf = argv[i] + 4;
+		else if(!strncmp(argv[i], "nick=", 5))
+			who = argv[i] + 5;
+		else if(!strncmp(argv[i], "from=", 5))
+			from = arctime(argv[i] + 5, 0);
+		else if(!strncmp(argv[i], "to=", 3))
+			to = arctime(argv[i] + 3, 1);
+		else
+			usage();
+	}
+	for(p = buf; *p; ++p)
+		*p = CASEMAP((unsigned char)*p, CaseRfc1459);
+	for(p = who; *p; ++p)
+		*p = CASEMAP((unsigned char)*p, CaseRfc1459);
+	snprintf(path, sizeof path, "%s/archive.idx", logdir);
+	if((ifd = open(path, O_RDONLY)) < 0 || fstat(ifd, &st) < 0)
+		die("%s:", path);
+	if(st.st_size < sizeof(ArcBlock))
+		return;
+	if((idx = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ifd, 0)) == MAP_FAILED)
+		die("mmap():");
+	snprintf(path, sizeof path, "%s/archive", logdir);
+	if((fd = open(path, O_RDONLY)) < 0)
+		die("%s:", path);
+	for(ab = idx; ab < idx + st.st_size / sizeof(ArcBlock); ++ab) {
+		if(ab->t1 < from || ab->t0 > to)
+			continue;
+		if(*buf && strcmp(ab->buf, buf)
+		&& (!(p = strchr(ab->buf, '/')) || strcmp(p + 1, buf)))
+			continue;
+		if(*who && !arcbloom(ab->bloom, who, 0))
+			continue;
+		if(ab->len > BUFSEG || ab->zlen > ab->len
+		|| pread(fd, ab->zlen == ab->len ? text : z, ab->zlen, ab->off) != ab->zlen)
+			continue;
+		if(ab->zlen != ab->len && lzunpack(z, ab->zlen, text, ab->len) != ab->len)
+			continue;
+		for(l = text, e = text + ab->len; l < e; l = nl + 1) {
+			if(!(nl = memchr(l, '\n', e - l)))
+				nl = e;
+			n = nl - l < sizeof head ? nl - l : sizeof head - 1;
+			memcpy(head, l, n);
+			head[n] = '\0';
+			t = strtol(head, &p, 10);
+			if(t < from || t > to)
+				continue;
+			if(*who && (!arcnick(head, nick, sizeof nick) || strcmp(nick, who)))
+				continue;
+			strftime(tbuf, sizeof tbuf, "%F %T", localtime(&t));
+			printf("%s %s%.*s\n", tbuf, ab->buf, (int)(nl - (l + (p - head))), l + (p - head));
+		}
+	}
+	munmap(idx, st.st_size);
+	close(fd);
+	close(ifd);
+}
+
+/* Parse the time of a query: seconds since the epoch, or a local date with
+ * an optional time of the day. A date alone ends with the day when end. */
+time_t
+arctime(char *s, int end) {
+	struct tm tm;
+	char *p;
+	long t;
+
+	t = strtol(s, &p, 10);
+	if(!*p)
+		return t;
+	memset(&tm, 0, sizeof tm);
+	if(!(p = strptime(s, "%Y-%m-%d", &tm)))
+		die("%s: not a time", s);
+	if(*p && (!(p = strptime(p + 1, "%H:%M", &tm)) || *p))
+		die("%s: not a time", s);
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	return end && !strchr(s, ':') ? t + 86399 : t;
+}
+
 void
 attach(Buffer *b) {
+	Network *n = b->net;
+	Buffer *t;
+	unsigned int h;
+	int i;
+
 	b->next = buffers;
+	b->prev = buffers ? buffers->prev : b;
+	if(buffers)
+		buffers->prev = b;
 	buffers = b;
+	++nbuffers;
+	bufposok = 0;
+
+	if(++n->nbuffers > n->buftabsz) {
+		free(n->buftab);
+		n->buftabsz = n->buftabsz ? n->buftabsz * 2 : 64;
+		n->buftab = ecalloc(n->buftabsz, sizeof(Buffer *));
+		for(t = buffers; t; t = t->next) {
+			if(t->net != n)
+				continue;
+			i = casehash(n, t->name) & (n->buftabsz - 1);
+			t->hnext = n->buftab[i];
+			n->buftab[i] = t;
+		}
+		return;
+	}
+	h = casehash(n, b->name) & (n->buftabsz - 1);
+	b->hnext = n->buftab[h];
+	n->buftab[h] = b;
 }
 
 int
@@ -286,120 +879,300 @@ bprintf(Buffer *b, char *fmt, ...) {
 	return len;
 }
 
+/* Write a line to b after the time prefix, with a single append. */
 int
 bprintf_prefixed(Buffer *b, char *fmt, ...) {
 	va_list ap;
-	time_t t;
-	struct tm *tm;
-	char buf[64];
-	int len = 0;
-
-	if(*prefix_format) {
-		t = time(NULL);
-		tm = localtime(&t);
-		len = strftime(buf, sizeof buf, prefix_format, tm);
-		if(!len)
-			len = strftime(buf, sizeof buf, "%T | ", tm); /* fallback */
-		buf[len] = '\0';
-		len = bprintf(b, "%s", buf);
-	}
-	va_start(ap, fmt);
 
+	lnbegin();
+	va_start(ap, fmt);
+	lnvprintf(fmt, ap);
+	va_end(ap);
 #ifdef DEBUG
-	int olen = b->len;
-	len += bvprintf(b, fmt, ap);
-	logfmt("%ld DEBUG bvprintf() %s", time(NULL), &b->data[olen]); /* \n is already there from the caller */
-#else
-	len += bvprintf(b, fmt, ap);
+	logfmt(NULL, "%ld DEBUG bvprintf() %s", (long)msgtime, lnbuf); /* \n is already there from the caller */
 #endif
-	va_end(ap);
-	return len;
+	return lncommit(b);
 }
 
-int
-bufinfo(char *buf, int len, int val, int act) {
-	int x, y, i;
-
-	for(i = 0, x = y = 1; i < len; ++i) {
-		switch(act) {
-		case LineToOffset:
-			if(val == y)
-				return i;
-			break;
-		case OffsetToLine:
-			if(val == i)
-				return y;
-			break;
+/* Index the lines of b, as wrapped at b->lncols columns, from where the
+ * last call stopped. The scan state (offset and column) lives in the buffer so
+ * that appending only costs the new bytes. Reset b->lnscan to reindex, the
+ * compressed segments are compressed again once scanned. */
+void
+bufindex(Buffer *b) {
+	unsigned int cp;
+	int i, nb, w, brk, seg = -1, zipped = 0;
+	char *p, *endp;
+
+	if(!b->lnscan) {
+		b->nlines = 0;
+		b->lnx = 1;
+		b->lnscan = b->lnidx[0] = b->segfirst * BUFSEG;
+	}
+	for(i = b->lnscan; i < b->len; i += nb) {
+		if(i / BUFSEG != seg) {
+			if(zipped)
+				segzip(b, seg);
+			seg = i / BUFSEG;
+			zipped = !b->segs[seg].data && b->segs[seg].z;
+		}
+		if(i % BUFSEG >= b->segs[i / BUFSEG].len) {
+			nb = BUFSEG - i % BUFSEG; /* end of segment */
+			continue;
+		}
+		p = BUFPTR(b, i);
+		if(*p == UI_BYTE) {
+			strtol(p + 1, &endp, 10);
+			nb = endp - p;
+			continue;
+		}
+		if(*p == '\n') {
+			nb = 1;
+			brk = i + 1;
+			w = 0;
 		}
-		if(x == cols || buf[i] == '\n') {
-			if(buf[i] != '\n' && i < len - 1 && buf[i + 1] == '\n')
-				++i;
-			x = 1;
-			++y;
+		else {
+			nb = utf8decode(p, &cp);
+			w = cpwidth(cp);
+			if(w < 0)
+				w = 0;
+			if(b->lnx + w - 1 <= b->lncols || b->lnx == 1) {
+				b->lnx += w;
+				continue;
+			}
+			brk = i; /* the glyph does not fit, wrap it */
+		}
+		if(b->nlines + 1 >= b->lnidxsz) {
+			b->lnidxsz *= 2;
+			if(!(b->lnidx = realloc(b->lnidx, b->lnidxsz * sizeof(int))))
+				die("realloc():");
+		}
+		b->lnidx[++b->nlines] = brk;
+		b->lnx = 1 + w;
+	}
+	if(zipped)
+		segzip(b, seg);
+	b->lnscan = i;
+}
+
+int
+bufinfo(Buffer *b, int val, int act) {
+	int lo, hi, mid;
+
+	switch(act) {
+	case LineToOffset:
+		if(val < 1 || val > b->nlines + 1 || b->lnidx[val - 1] >= b->len)
+			return -1;
+		return b->lnidx[val - 1];
+	case OffsetToLine:
+		if(val < 0 || val >= b->len)
+			return -1;
+		for(lo = 0, hi = b->nlines; lo < hi;) {
+			mid = (lo + hi + 1) / 2;
+			if(b->lnidx[mid] <= val)
+				lo = mid;
+			else
+				hi = mid - 1;
 		}
+		return lo + 1;
+	case TotalLines:
+		return b->nlines;
+	}
+	return -1;
+}
+
+/* Uncompress the segment holding off, called by BUFPTR() when the segment is
+ * not resident. Dropped segments read as empty. */
+char *
+bufload(Buffer *b, int off) {
+	Segment *sg = &b->segs[off / BUFSEG];
+
+	if(!sg->z)
+		return "";
+	sg->data = ecalloc(1, BUFSEG);
+	if(lzunpack(sg->z, sg->zlen, sg->data, BUFSEG - 1) < 0)
+		die("%s: corrupted scrollback\n", b->name);
+	free(sg->z);
+	sg->z = NULL;
+	b->memres += BUFSEG;
+	b->memzip -= sg->zlen;
+	memres += BUFSEG;
+	memzip -= sg->zlen;
+	sg->zlen = 0;
+	memcheck = 1;
+	return &sg->data[off % BUFSEG];
+}
+
+/* Wrap b at the current width. Only the selected buffer is reflowed when the
+ * terminal gets resized, the others wait until they get the focus. */
+void
+bufreflow(Buffer *b) {
+	if(b->lncols == cols && b->lnscan == b->len)
+		return;
+	if(b->lncols != cols) {
+		b->lncols = cols;
+		b->lnscan = 0;
+	}
+	bufindex(b);
+	if(b->line) {
+		b->line = bufinfo(b, b->lnoff, OffsetToLine);
+		if(b->line < 1 || b->line > b->nlines - (rows - 2))
+			b->line = b->lnoff = 0;
+		else
+			b->lnoff = bufinfo(b, b->line, LineToOffset);
+	}
+}
+
+void
+bufstamp(Buffer *b, int off, time_t t) {
+	if(b->nstamps && b->stamps[b->nstamps - 1].t == t)
+		return;
+	if(b->nstamps == b->stampssz) {
+		b->stampssz = b->stampssz ? b->stampssz * 2 : 16;
+		if(!(b->stamps = realloc(b->stamps, b->stampssz * sizeof(Stamp))))
+			die("realloc():");
+	}
+	b->stamps[b->nstamps].off = off;
+	b->stamps[b->nstamps++].t = t;
+}
+
+/* Return the time the text at off was received, 0 if unknown. */
+time_t
+buftime(Buffer *b, int off) {
+	int lo, hi, mid;
+
+	if(!b->nstamps || b->stamps[0].off > off)
+		return 0;
+	for(lo = 0, hi = b->nstamps - 1; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if(b->stamps[mid].off <= off)
+			lo = mid;
 		else
-			++x;
+			hi = mid - 1;
 	}
-	return (act == TotalLines ? y : 0) - 1;
+	return b->stamps[lo].t;
 }
 
 int
 bvprintf(Buffer *b, char *fmt, va_list ap) {
 	va_list ap2;
-	int len;
+	int len, room;
 
 	va_copy(ap2, ap);
-	len = vsnprintf(&b->data[b->len], b->size - b->len, fmt, ap);
-	if(len >= b->size - b->len) {
-		b->size += len + 1;
-		b->data = realloc(b->data, b->size);
-		if(!b->data)
-			die("realloc():");
-		len = vsnprintf(&b->data[b->len], b->size - b->len, fmt, ap2);
+	len = room = 0;
+	if(b->nsegs && !b->segs[b->nsegs - 1].mapped) {
+		room = BUFSEG - b->len % BUFSEG;
+		len = vsnprintf(BUFPTR(b, b->len), room, fmt, ap);
+		if(len >= room)
+			*BUFPTR(b, b->len) = '\0'; /* leave the segment as it was */
+	}
+	if(len >= room) {
+		segadd(b, ecalloc(1, BUFSEG));
+		b->memres += BUFSEG;
+		memres += BUFSEG;
+		memcheck = 1;
+		b->len = (b->nsegs - 1) * BUFSEG;
+		len = vsnprintf(BUFPTR(b, b->len), BUFSEG, fmt, ap2);
+		if(len >= BUFSEG)
+			len = BUFSEG - 1; /* truncated */
 	}
 	va_end(ap2);
 	if(len < 0)
 		return -1;
 	b->len += len;
-	b->nlines = bufinfo(b->data, b->len, 0, TotalLines);
+	b->segs[b->nsegs - 1].len += len;
+	bufstamp(b, b->len - len, msgtime);
+	if(b->storeon)
+		storeput(b, BUFPTR(b, b->len - len), len);
+	if(b->lncols == cols)
+		bufindex(b);
 	b->need_redraw |= REDRAW_BUFFER;
 	return len;
 }
 
+/* Compare strings with the casemapping of n. */
+int
+casecmp(Network *n, char *a, char *b) {
+	for(; *a && CASEMAP((unsigned char)*a, n->casemap) == CASEMAP((unsigned char)*b, n->casemap); ++a, ++b);
+	return CASEMAP((unsigned char)*a, n->casemap) - CASEMAP((unsigned char)*b, n->casemap);
+}
+
+unsigned int
+casehash(Network *n, char *s) {
+	unsigned int h = 2166136261u;
+
+	for(; *s; ++s)
+		h = (h ^ CASEMAP((unsigned char)*s, n->casemap)) * 16777619u;
+	return h;
+}
+
 void
 cleanup(void) {
+	Network *n;
 	Buffer *b;
 
+	logclose();
 	while((b = buffers)) {
 		buffers = buffers->next;
 		freebuf(b);
 	}
-	tcsetattr(0, TCSANOW, &origti);
+	while((n = networks)) {
+		networks = n->next;
+		free(n->buftab);
+		free(n->usertab);
+		free(n);
+	}
+	free(bufpos);
+	free(lnbuf);
+	if(daemonize)
+		unlink(sockpath);
+	else
+		tcsetattr(0, TCSANOW, &origti);
 }
 
 void
 cmd_close(char *cmd, char *s) {
 	Buffer *b;
 
-	b = *s ? getbuf(s) : sel;
+	b = *s ? getbuf(sel->net, s) : sel;
 	if(!b) {
-		bprintf_prefixed(status, "/%s: %s: unknown buffer.\n", cmd, s);
+		bprintf_prefixed(sel->net->status, "/%s: %s: unknown buffer.\n", cmd, s);
 		return;
 	}
-	if(b == status) {
-		bprintf_prefixed(status, "/%s: cannot close the status.\n", cmd);
+	if(b == b->net->status) {
+		bprintf_prefixed(b, "/%s: cannot close the status.\n", cmd);
 		return;
 	}
-	if(srv && ISCHAN(b) && !b->kicked)
-		sout("PART :%s", b->name); /* Note: you may be not in that channel */
+	if(b->net->srv && ischan(b->net, b->name) && !b->kicked)
+		sout(b->net, SendText, "PART :%s", b->name); /* Note: you may be not in that channel */
 	destroy(b);
 }
 
+void
+cmd_detach(char *cmd, char *s) {
+	if(!daemonize) {
+		bprintf_prefixed(sel, "/%s: not running as a daemon.\n", cmd);
+		return;
+	}
+	usrdrop();
+}
+
+void
+cmd_mem(char *cmd, char *s) {
+	Buffer *b;
+
+	for(b = buffers; b; b = b->next)
+		bprintf_prefixed(sel, "%s: %ld KiB resident, %ld KiB compressed, %d segments dropped\n",
+			b->name, b->memres / 1024, b->memzip / 1024, b->segfirst);
+	bprintf_prefixed(sel, "total: %ld KiB resident, %ld KiB compressed (budget %lu KiB, cap %lu KiB)\n",
+		memres / 1024, memzip / 1024, scrollmem / 1024, scrollmax / 1024);
+}
+
 void
 cmd_msg(char *cmd, char *s) {
 	char *to, *txt;
 
-	if(!srv) {
+	if(!sel->net->srv) {
 		bprintf_prefixed(sel, "/%s: not connected.\n", cmd);
 		return;
 	}
@@ -410,87 +1183,130 @@ cmd_msg(char *cmd, char *s) {
 		bprintf_prefixed(sel, "Usage: /%s <channel or user> <text>\n", cmd);
 		return;
 	}
-	privmsg(to, txt);
+	privmsg(sel->net, to, txt);
+}
+
+/* Connect to one more server, or list the networks. */
+void
+cmd_network(char *cmd, char *s) {
+	Network *n;
+	char *p;
+
+	if(!*s) {
+		for(n = networks; n; n = n->next)
+			bprintf_prefixed(sel, "%s@%s:%s (%s)\n", n->nick, n->host, n->port, netstate(n));
+		return;
+	}
+	p = skip(s, ' ');
+	n = newnet(s, *p ? p : port);
+	focus(n->status);
+	dial(n);
 }
 
 void
 cmd_quit(char *cmd, char *msg) {
-	if(srv)
-		quit(*msg ? msg : QUIT_MESSAGE);
+	Network *n;
+
+	for(n = networks; n; n = n->next)
+		quit(n, *msg ? msg : QUIT_MESSAGE);
 	running = 0;
 }
 
 void
 cmd_rejoinall(char *cmd, char *s) {
+	Network *n = sel->net;
 	Buffer *b;
 
-	if(!srv) {
+	if(!n->srv) {
 		bprintf_prefixed(sel, "/%s: not connected.\n", cmd);
 		return;
 	}
 	for(b = buffers; b; b = b->next)
-		if(ISCHAN(b))
-			sout("JOIN %s", b->name);
+		if(b->net == n && ischan(n, b->name))
+			sout(n, SendBulk, "JOIN %s", b->name);
 }
 
 void
 cmd_server(char *cmd, char *s) {
+	Network *n = sel->net;
+	Buffer *b;
 	char *t;
-	int fd;
 
 	t = skip(s, ' ');
-	if(!*t)
-		t = port;
-	else
-		strncpy(port, t, sizeof port);
-	t = s;
-	if(!*t)
-		t = host;
-	else
-		strncpy(host, t, sizeof host);
-	if(srv)
-		quit(QUIT_MESSAGE);
-	if((fd = dial(host, port, SOCK_NONBLOCK)) < 0) {
-		bprintf_prefixed(status, "Cannot connect to %s on port %s.\n", host, port);
-		return;
+	if(*t)
+		strncpy(n->port, t, sizeof n->port - 1);
+	if(*s && strncmp(n->host, s, sizeof n->host - 1)) {
+		strncpy(n->host, s, sizeof n->host - 1);
+		/* the files of the buffers are under the host, see storepath() */
+		for(b = buffers; b; b = b->next) {
+			if(b->net != n)
+				continue;
+			storeclose(b);
+			free(b->logpath);
+			free(b->histpath);
+			b->logpath = b->histpath = NULL;
+		}
 	}
-	srv = fdopen(fd, "r+");
-	setbuf(srv, NULL);
+	if(n->srv)
+		quit(n, QUIT_MESSAGE);
+	timerdel(&n->retrytimer);
+	dial(n);
 	sel->need_redraw |= REDRAW_BAR;
 }
 
+void
+cmd_stats(char *cmd, char *s) {
+	Network *n;
+	int i;
+
+	for(i = 0; i < LENGTH(messages); ++i)
+		if(messages[i].hits)
+			bprintf_prefixed(sel, "%-8s %lu\n", messages[i].name, messages[i].hits);
+	bprintf_prefixed(sel, "%-8s %lu\n", "other", unhandled);
+	bprintf_prefixed(sel, "log: %lu bytes queued, %lu lines dropped\n",
+		loghead - __atomic_load_n(&logtail, __ATOMIC_ACQUIRE), logdrops);
+	for(n = networks; n; n = n->next) {
+		bprintf_prefixed(sel, "%s: sent %lu lines, %lu bytes, paced %lu times\n",
+			n->host, n->sentlines, n->sentbytes, n->sendstalls);
+		for(i = 0; i < SendLast; ++i)
+			bprintf_prefixed(sel, "%s: queue %d: %d lines, %d at most\n",
+				n->host, i, n->sendq[i].n, n->sendq[i].max);
+	}
+}
+
 void
 cmd_topic(char *cmd, char *s) {
+	Network *n = sel->net;
 	char *chan, *txt;
 
-	if(!srv) {
+	if(!n->srv) {
 		bprintf_prefixed(sel, "/%s: not connected.\n", cmd);
 		return;
 	}
 	if(!*s) {
-		if(ISCHAN(sel))
-			sout("TOPIC %s", sel->name);
+		if(ischan(n, sel->name))
+			sout(n, SendText, "TOPIC %s", sel->name);
 		else
 			bprintf_prefixed(sel, "/%s: %s in not a channel.\n", cmd, sel->name);
 		return;
 	}
-	if(ISCHANPFX(*s)) {
+	if(ischan(n, s)) {
 		chan = s;
 		txt = skip(s, ' ');
 		if(!*txt) {
-			sout("TOPIC %s", chan);
+			sout(n, SendText, "TOPIC %s", chan);
 			return;
 		}
 	}
 	else {
-		if(sel == status) {
+		if(sel == n->status) {
 			bprintf_prefixed(sel, "Usage: /%s [channel] [text]\n", cmd);
 			return;
 		}
 		chan = sel->name;
 		txt = s;
 	}
-	sout("TOPIC %s :%s", chan, txt);
+	sout(n, SendText, "TOPIC %s :%s", chan, txt);
 }
 
 void
@@ -576,7 +1392,7 @@ cmdln_complete(const Arg *arg) {
 		++ws;
 		--wlen;
 	}
-	else if(ISCHANPFX(word[0])) {
+	else if(ischan(sel->net, word)) {
 		/* search buffer name */
 		if(strncasecmp(sel->name, word, wlen))
 			return;
@@ -586,12 +1402,12 @@ cmdln_complete(const Arg *arg) {
 	else {
 		/* match a nick in current buffer */
 		for(n = sel->names; n && !match; n = n->next)
-			if(!strncasecmp(n->name, word, wlen))
+			if(!strncasecmp(n->user->name, word, wlen))
 				break;
 		if(!n)
 			return;
-		match = n->name;
-		mlen = n->len;
+		match = n->user->name;
+		mlen = n->user->len;
 	}
 
 	we = ws + wlen;
@@ -649,12 +1465,12 @@ cmdln_submit(const Arg *arg) {
 		return;
 
 #ifdef DEBUG
-	logfmt("%ld DEBUG cmdln_submit() %s\n", time(NULL), sel->cmdbuf);
+	logfmt(NULL, "%ld DEBUG cmdln_submit() %s\n", (long)msgtime, sel->cmdbuf);
 #endif
-	buf = ecalloc(1, sel->cmdlen);
+	buf = ecalloc(1, sel->cmdlen + 1);
 	memcpy(buf, sel->cmdbuf, sel->cmdlen);
 
-	histpush(sel->cmdbuf, sel->cmdlen);
+	histpush(sel, sel->cmdbuf, sel->cmdlen, 1);
 	if(buf[0] == '/') {
 		sel->cmdlen = sel->cmdoff = sel->histlnoff = 0;
 		sel->cmdbuf[sel->cmdlen] = '\0';
@@ -664,12 +1480,12 @@ cmdln_submit(const Arg *arg) {
 		parsecmd(buf);
 	}
 	else {
-		if(sel == status)
+		if(sel == sel->net->status)
 			bprintf_prefixed(sel, "Cannot send text here.\n");
-		else if(!srv)
+		else if(!sel->net->srv)
 			bprintf_prefixed(sel, "Not connected.\n");
 		else
-			privmsg(sel->name, sel->cmdbuf);
+			privmsg(sel->net, sel->name, sel->cmdbuf);
 		sel->cmdlen = sel->cmdoff = sel->histlnoff = 0;
 		sel->cmdbuf[sel->cmdlen] = '\0';
 		sel->need_redraw |= REDRAW_CMDLN;
@@ -698,12 +1514,28 @@ cmdln_wdel(const Arg *arg) {
 	sel->need_redraw |= REDRAW_CMDLN;
 }
 
+/* Like wcwidth(3) but locale independent. */
+int
+cpwidth(unsigned int cp) {
+	if(cp < 0x20 || (cp >= 0x7F && cp < 0xA0))
+		return -1;
+	if(cp < 0x300)
+		return 1;
+	if(intable(zerowidth, LENGTH(zerowidth), cp))
+		return 0;
+	if(intable(widewidth, LENGTH(widewidth), cp))
+		return 2;
+	return 1;
+}
+
 void
 destroy(Buffer *b) {
 	if(b == sel) {
 		sel = sel->next ? sel->next : buffers;
 		sel->need_redraw |= REDRAW_ALL;
 	}
+	if(shown == b)
+		shown = NULL;
 	detach(b);
 	freebuf(b);
 
@@ -713,32 +1545,177 @@ void
 detach(Buffer *b) {
 	Buffer **tb;
 
-	for (tb = &buffers; *tb && *tb != b; tb = &(*tb)->next);
-	*tb = b->next;
+	if(b == buffers)
+		buffers = b->next;
+	else
+		b->prev->next = b->next;
+	if(b->next)
+		b->next->prev = b->prev;
+	else if(buffers)
+		buffers->prev = b->prev;
+	bufposok = 0;
+	--nbuffers;
+	--b->net->nbuffers;
+
+	for(tb = &b->net->buftab[casehash(b->net, b->name) & (b->net->buftabsz - 1)]; *tb && *tb != b; tb = &(*tb)->hnext);
+	if(*tb)
+		*tb = b->hnext;
 }
 
-int
-dial(char *host, char *port, int flags) {
-	static struct addrinfo hints;
-	struct addrinfo *res, *r;
-	int srvfd;
+/* Connect to host on port. The name is looked up by resolve() and the
+ * connection goes on in dialin(). */
+void
+dial(Network *n) {
+	pthread_attr_t attr;
+	pthread_t t;
+
+	dialstop(n);
+	n->lookup = ecalloc(1, sizeof(Lookup));
+	n->lookup->net = n;
+	memcpy(n->lookup->host, n->host, sizeof n->lookup->host);
+	memcpy(n->lookup->port, n->port, sizeof n->lookup->port);
+	n->dialt0 = mstime();
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&t, &attr, resolve, n->lookup))
+		die("cannot start the resolver");
+	pthread_attr_destroy(&attr);
+}
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	if(getaddrinfo(host, port, &hints, &res) != 0)
-		return -1;
-	for(r = res; r; r = r->ai_next) {
-		if((srvfd = socket(r->ai_family, r->ai_socktype | flags, r->ai_protocol)) == -1)
-			continue;
-		if(connect(srvfd, r->ai_addr, r->ai_addrlen) == 0 || errno == EINPROGRESS)
+/* A lookup is over. The addresses are tried alternating the families, from
+ * the one getaddrinfo(3) prefers, as RFC 8305 says. */
+void
+dialin(Watch *w, int events) {
+	struct addrinfo *p, *q;
+	Network *n;
+	Lookup *lk;
+	int f;
+
+	if(read(w->fd, &lk, sizeof lk) != sizeof lk)
+		return;
+	n = lk->net;
+	if(lk != n->lookup) {
+		/* given up on already */
+		if(lk->res)
+			freeaddrinfo(lk->res);
+		free(lk);
+		return;
+	}
+	n->lookup = NULL;
+	n->dnsms = mstime() - n->dialt0;
+	if(lk->err) {
+		bprintf_prefixed(n->status, "Cannot resolve %s: %s.\n", lk->host, gai_strerror(lk->err));
+		free(lk);
+		sel->need_redraw |= REDRAW_BAR;
+		retry(n);
+		return;
+	}
+	n->dialres = lk->res;
+	free(lk);
+	f = n->dialres->ai_family;
+	for(p = q = n->dialres; n->naddrs < LENGTH(n->dialaddr); ) {
+		while(p && p->ai_family != f)
+			p = p->ai_next;
+		while(q && q->ai_family == f)
+			q = q->ai_next;
+		if(!p && !q)
 			break;
-		close(srvfd);
+		if(p && (!q || n->naddrs % 2 == 0)) {
+			n->dialaddr[n->naddrs++] = p;
+			p = p->ai_next;
+		}
+		else {
+			n->dialaddr[n->naddrs++] = q;
+			q = q->ai_next;
+		}
 	}
-	freeaddrinfo(res);
-	if(!r)
-		return -1;
-	return srvfd;
+	dialnext(n);
+}
+
+/* An attempt is over. The first one to connect wins, the others are dropped,
+ * and a failure starts the next one at once. */
+void
+dialio(Watch *w, int events) {
+	Attempt *a = (Attempt *)w;
+	Network *n = w->arg;
+	socklen_t len;
+	int err = 0, fd = w->fd;
+
+	if(fd < 0)
+		return;
+	len = sizeof err;
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	watch(w, -1, 0);
+	--n->dialing;
+	if(err) {
+		close(fd);
+		dialnext(n);
+		return;
+	}
+	bprintf_prefixed(n->status, "Connected to %s over %s in %lld ms, resolving took %lld ms.\n",
+		n->host, a->family == AF_INET6 ? "IPv6" : "IPv4", mstime() - n->dialt0, n->dnsms);
+	dialstop(n);
+	n->srv = fdopen(fd, "r+");
+	setbuf(n->srv, NULL);
+	watch(&n->watch, fd, EPOLLIN);
+	n->trespond = now;
+	timerset(&n->keeptimer, mstime() + 120000);
+}
+
+/* Start an attempt to the next address, and the one after it in 250 ms
+ * unless this one is over sooner. */
+void
+dialnext(void *arg) {
+	Network *n = arg;
+	struct addrinfo *r;
+	Attempt *a;
+	int fd;
+
+	timerdel(&n->dialtimer);
+	while(n->dialn < n->naddrs) {
+		r = n->dialaddr[n->dialn];
+		a = &n->dialv[n->dialn++];
+		a->w.fd = -1; /* not in progress, see dialstop() */
+		if((fd = socket(r->ai_family, r->ai_socktype | SOCK_NONBLOCK, r->ai_protocol)) < 0)
+			continue;
+		if(connect(fd, r->ai_addr, r->ai_addrlen) < 0 && errno != EINPROGRESS) {
+			close(fd);
+			continue;
+		}
+		a->w.func = dialio;
+		a->w.arg = n;
+		a->family = r->ai_family;
+		watch(&a->w, fd, EPOLLOUT);
+		++n->dialing;
+		timerset(&n->dialtimer, mstime() + 250);
+		return;
+	}
+	if(n->dialing)
+		return;
+	dialstop(n);
+	bprintf_prefixed(n->status, "Cannot connect to %s on port %s.\n", n->host, n->port);
+	retry(n);
+}
+
+/* Give up the lookup and the attempts in progress. */
+void
+dialstop(Network *n) {
+	int i, fd;
+
+	n->lookup = NULL; /* freed by dialin() when it comes */
+	timerdel(&n->dialtimer);
+	for(i = 0; i < n->dialn; ++i) {
+		if((fd = n->dialv[i].w.fd) < 0)
+			continue;
+		watch(&n->dialv[i].w, -1, 0);
+		close(fd);
+	}
+	n->naddrs = n->dialn = n->dialing = 0;
+	if(n->dialres)
+		freeaddrinfo(n->dialres);
+	n->dialres = NULL;
+	sel->need_redraw |= REDRAW_BAR;
 }
 
 void
@@ -760,32 +1737,36 @@ die(const char *fmt, ...) {
 
 void
 draw(void) {
-	printf(CURSOFF);
 	if(sel->need_redraw & REDRAW_BAR)
 		drawbar();
 	if(sel->need_redraw & REDRAW_BUFFER)
 		drawbuf();
 	if(sel->need_redraw & REDRAW_CMDLN)
 		drawcmdln();
-	printf(CURPOS CURSON, rows, sel->cmdpos);
+	scrflush();
 }
 
 void
 drawbar(void) {
 	Buffer *b;
 	char buf[512];
+	time_t t;
 	int x = 1, len = 0;
 
 	if(!(cols && rows))
 		return;
 
-	if(ISCHAN(sel))
+	if(ischan(sel->net, sel->name))
 		len += snprintf(buf, sizeof buf, "%d users in %s", sel->totnames, sel->name);
 	else
 		len += snprintf(buf, sizeof buf, "%s@%s:%s (%s)",
-			*nick ? nick : "[nick unset]", host, port,
-			srv ? (online ? "online" : "connecting...") : "offline");
-	if(sel->line)
+			*sel->net->nick ? sel->net->nick : "[nick unset]",
+			sel->net->host, sel->net->port, netstate(sel->net));
+	if(sel->line && (t = buftime(sel, sel->lnoff))) {
+		len += snprintf(&buf[len], sizeof buf - len, " [scrolled to ");
+		len += strftime(&buf[len], sizeof buf - len, "%F %R]", localtime(&t));
+	}
+	else if(sel->line)
 		len += snprintf(&buf[len], sizeof buf - len, " [scrolled]");
 
 #ifdef DEBUG
@@ -793,8 +1774,7 @@ drawbar(void) {
 #endif
 
 	len = gcsfitcols(buf, cols - x + 1) - buf;
-	mvprintf(x, 1, "%.*s", len, buf);
-	x += gcswidth(buf, len);
+	x = scrput(x, 1, buf, len);
 
 	for(b = buffers; b; b = b->next) {
 		if(!b->notify)
@@ -802,71 +1782,61 @@ drawbar(void) {
 		snprintf(buf, sizeof buf, " %s(%d)", b->name, b->notify);
 		len = gcsfitcols(buf, cols - x + 1) - buf;
 		uiset(NULL, NickMention);
-		mvprintf(x, 1, "%.*s", len, buf);
+		x = scrput(x, 1, buf, len);
 		uiset(NULL, -1);
-		x += gcswidth(buf, len);
 	}
-	if(x < cols)
-		mvprintf(x, 1, CLEARRIGHT);
+	scrclear(x, 1);
 }
 
 void
 drawbuf(void) {
-	int x, y, c, i, nb, nx;
-	char *endp;
+	unsigned int cp;
+	int x, y, c, i, e, l, nb, w;
+	char *p, *endp;
 
 	if(!(cols && rows))
 		return;
-
-	x = rows - 2;
-	y = sel->nlines - x;
-	i = sel->line
-		? sel->lnoff
-		: sel->len ? bufinfo(sel->data, sel->len, 1 + (sel->nlines > x ? y : 0), LineToOffset) : 0;
-	x = 1;
-	y = 2;
-
-	for(; i < sel->len; ++i) {
-                if(sel->data[i] == UI_BYTE) {
-			c = strtol(&sel->data[++i], &endp, 10);
-			i += endp - &sel->data[i] - 1;
-			uiset(NULL, c);
-			continue;
-		}
-
-		c = sel->data[i];
-		if(x <= cols) {
-			if(c != '\n') {
-				nb = UTF8BYTES(c);
-				nx = x + gcswidth(&sel->data[i], 1);
-				if(nx - 1 <= cols) {
-					mvprintf(x, y, "%.*s", nb, &sel->data[i]);
-					x = nx;
-					i += nb - 1;
-					continue;
-				}
+	bufreflow(sel);
+
+	l = sel->line ? sel->line - 1 : sel->nlines - (rows - 2);
+	if(l < 0)
+		l = 0;
+	/* new lines at the bottom only need the old ones to be scrolled up */
+	if(shown == sel && !sel->line)
+		scrscroll(2, rows - 1, l - (shownlines > rows - 2 ? shownlines - (rows - 2) : 0));
+	shown = sel->line ? NULL : sel;
+	shownlines = sel->nlines;
+	for(y = 2; y < rows; ++y, ++l) {
+		x = 1;
+		i = l <= sel->nlines ? sel->lnidx[l] : sel->len;
+		e = l < sel->nlines ? sel->lnidx[l + 1] : sel->len;
+		for(; i < e; i += nb) {
+			if(i % BUFSEG >= sel->segs[i / BUFSEG].len) {
+				nb = BUFSEG - i % BUFSEG; /* end of segment */
+				continue;
+			}
+			p = BUFPTR(sel, i);
+			c = *p;
+			if(c == UI_BYTE) {
+				c = strtol(p + 1, &endp, 10);
+				nb = endp - p;
+				uiset(NULL, c);
+				continue;
 			}
-			mvprintf(x, y, "%s", CLEARRIGHT);
+			nb = utf8decode(p, &cp);
+			if(c == '\n')
+				continue;
+			w = cpwidth(cp);
+			if(w < 0)
+				w = 0;
+			if(x + w - 1 > cols)
+				continue;
+			x = scrput(x, y, p, nb);
 		}
-
-		x = 1;
-		if(++y == rows)
-			break;
-		if(c != '\n') {
-			nb = UTF8BYTES(c);
-			mvprintf(x, y, "%.*s", nb, &sel->data[i]);
-			x += gcswidth(&sel->data[i], 1);
-			i += nb - 1;
-		}
-		if(x > cols && i < sel->len - 1 && sel->data[i + 1] == '\n')
-			++i;
-	}
-	if(y < rows) {
-		mvprintf(x, y, "%s", CLEARRIGHT);
-		while(++y < rows)
-			mvprintf(1, y, "%s", CLEARLN);
-	}
-}
+		uiset(NULL, -1);
+		scrclear(x, y);
+	}
+}
 
 void
 drawcmdln(void) {
@@ -881,7 +1851,7 @@ drawcmdln(void) {
 	w = gcswidth(prompt, colw - 1);
 	if(w > 0) {
 		s = gcsfitcols(prompt, colw - 1) - prompt;
-		mvprintf(x, rows, "%.*s", s, prompt);
+		scrput(x, rows, prompt, s);
 		x += w;
 		colw -= w;
 		sel->cmdpos += w;
@@ -902,13 +1872,25 @@ drawcmdln(void) {
 	}
 
 	s = w ? gcsfitcols(buf, colw) - buf : 0;
-	mvprintf(x, rows, "%.*s%s", s, buf, w < colw ? CLEARRIGHT : "");
+	scrclear(scrput(x, rows, buf, s), rows);
 
 	/* cursor position */
 	for(p = buf; p < &sel->cmdbuf[sel->cmdoff]; p += UTF8BYTES(*p))
 		sel->cmdpos += gcswidth(p, 1);
 }
 
+/* Draw what changed. Called by drawtimer at most maxfps times per second and
+ * right away on typing. */
+void
+drawframe(void *arg) {
+	timerdel(&drawtimer);
+	if(!sel->need_redraw || outfd < 0)
+		return;
+	draw();
+	sel->need_redraw = 0;
+	drawlast = mstime();
+}
+
 void *
 ecalloc(size_t nmemb, size_t size) {
 	void *p;
@@ -926,6 +1908,7 @@ focus(Buffer *b) {
 		b->notify = 0;
 	sel = b;
 	sel->need_redraw |= REDRAW_ALL;
+	memcheck = 1; /* the old one may be compressed now */
 }
 
 void
@@ -941,28 +1924,24 @@ focusnext(const Arg *arg) {
 void
 focusnum(const Arg *arg) {
 	Buffer *b;
-	int i = arg->i;
+	int i;
 
-	for(b = buffers; b; b = b->next)
-		if(--i < 0)
-			break;
-	focus(b);
+	if(!bufposok) {
+		free(bufpos);
+		bufpos = ecalloc(nbuffers, sizeof(Buffer *));
+		for(b = buffers, i = 0; b; b = b->next)
+			bufpos[i++] = b;
+		bufposok = 1;
+	}
+	if(arg->i >= 0 && arg->i < nbuffers)
+		focus(bufpos[arg->i]);
 }
 
 void 
 focusprev(const Arg *arg) {
-	Buffer *b, *nb;
+	Buffer *nb;
 
-	nb = sel;
-	if(sel == buffers) {
-		for(b = buffers; b; b = b->next)
-			nb = b;
-	}
-	else {
-		for(b = buffers; b && b->next; b = b->next)
-			if(b->next == sel)
-				nb = b;
-	}
+	nb = sel->prev;
 	if(nb == sel)
 		return;
 	focus(nb);
@@ -970,60 +1949,169 @@ focusprev(const Arg *arg) {
 
 void
 freebuf(Buffer *b) {
-	freenames(&b->names);
+	int i;
+
+	freenames(b);
+	free(b->nametab);
+	free(b->lnidx);
 	free(b->hist);
-	free(b->data);
+	free(b->histidx);
+	for(i = 0; i < b->nsegs; ++i) {
+		if(!b->segs[i].mapped)
+			free(b->segs[i].data);
+		free(b->segs[i].z);
+	}
+	if(b->map)
+		munmap(b->map, b->mapsz);
+	storeclose(b);
+	free(b->logpath);
+	free(b->histpath);
+	memres -= b->memres;
+	memzip -= b->memzip;
+	free(b->segs);
+	free(b->stamps);
 	free(b);
 }
 
 void
-freenames(Nick **names) {
-	Nick *n;
+freenames(Buffer *b) {
+	Nick *n, **tn;
+	NickSlab *sl;
 
-	while((n = *names)) {
-		*names = (*names)->next;
-		free(n);
+	for(n = b->names; n; n = n->next) {
+		for(tn = &n->user->chans; *tn && *tn != n; tn = &(*tn)->unext);
+		*tn = n->unext;
+		if(!--n->user->refs)
+			userdel(b->net, n->user);
+	}
+	while((sl = b->slabs)) {
+		b->slabs = sl->next;
+		free(sl);
+	}
+	b->names = b->freenicks = NULL;
+	if(b->nametab)
+		memset(b->nametab, 0, b->nametabsz * sizeof(Nick *));
+	b->totnames = 0;
+}
+
+/* Attach the terminal to circo -d, until either side goes away. The keys
+ * are passed as they are, along with the window size when it changes, and
+ * the frames come back ready to be written. */
+void
+frontend(void) {
+	struct sockaddr_un sa = { AF_UNIX };
+	struct signalfd_siginfo si;
+	struct pollfd pfd[3];
+	struct winsize ws;
+	sigset_t sigs;
+	char buf[4096];
+	int fd, i, n;
+
+	strncpy(sa.sun_path, sockpath, sizeof sa.sun_path - 1);
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+	|| connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		die("%s:", sockpath);
+	if(!peerok(fd))
+		die("%s: owned by another user", sockpath);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	pfd[0].fd = 0;
+	pfd[1].fd = fd;
+	pfd[2].fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	for(i = 0; i < LENGTH(pfd); ++i)
+		pfd[i].events = POLLIN;
+	ttyraw();
+	ioctl(0, TIOCGWINSZ, &ws);
+	dprintf(fd, "\x1b[8;%d;%dt", ws.ws_row, ws.ws_col);
+	for(;;) {
+		if(poll(pfd, LENGTH(pfd), -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(pfd[2].revents & POLLIN && read(pfd[2].fd, &si, sizeof si) == sizeof si) {
+			ioctl(0, TIOCGWINSZ, &ws);
+			dprintf(fd, "\x1b[8;%d;%dt", ws.ws_row, ws.ws_col);
+		}
+		if(pfd[0].revents & (POLLIN | POLLHUP)) {
+			if((n = read(0, buf, sizeof buf)) <= 0 || write(fd, buf, n) < 0)
+				break;
+		}
+		if(pfd[1].revents & (POLLIN | POLLHUP)) {
+			if((n = read(fd, buf, sizeof buf)) <= 0)
+				break;
+			fwrite(buf, 1, n, stdout);
+			fflush(stdout);
+		}
 	}
+	tcsetattr(0, TCSANOW, &origti);
+	printf(COLRST CURPOS "\n", ws.ws_row, 1);
 }
 
 char *
 gcsfitcols(char *s, int maxw) {
-	int w = 0;
+	unsigned int cp;
+	int w = 0, nb;
 
 	while(*s) {
-		w += gcswidth(s, 1);
+		nb = utf8decode(s, &cp);
+		w += cpwidth(cp);
 		if(w > maxw)
 			break;
-		s += UTF8BYTES(*s);
+		s += nb;
 	}
 	return s;
 }
 
+/* Width of the first len glyphs of s, or -1 if any is not printable. */
 int
 gcswidth(char *s, int len) {
-	wchar_t *wcs = malloc(len * sizeof(wchar_t) + 1);
-	int n;
-
-	if(!wcs)
-		return -1;
-	n = mbstowcs(wcs, s, len);
-	return n == -1 ? -1 : wcswidth(wcs, n);
+	unsigned int cp;
+	int n = 0, w;
+
+	for(; len > 0 && *s; --len) {
+		if(!(*s & 0x80)) {
+			if(*s < 0x20 || *s == 0x7F)
+				return -1;
+			++n;
+			++s;
+			continue;
+		}
+		s += utf8decode(s, &cp);
+		if((w = cpwidth(cp)) < 0)
+			return -1;
+		n += w;
+	}
+	return n;
 }
 
 Buffer *
-getbuf(char *name) {
+getbuf(Network *n, char *name) {
 	Buffer *b;
 
-	for(b = buffers; b; b = b->next)
-		if(!strcmp(b->name, name))
+	if(!n->buftabsz)
+		return NULL;
+	for(b = n->buftab[casehash(n, name) & (n->buftabsz - 1)]; b; b = b->hnext)
+		if(!casecmp(n, b->name, name))
 			return b;
 	return NULL;
 }
 
+Message *
+getmsg(char *cmd) {
+	Message *m;
+
+	if(isdigit(cmd[0]) && isdigit(cmd[1]) && isdigit(cmd[2]) && !cmd[3])
+		return numerics[(cmd[0] - '0') * 100 + (cmd[1] - '0') * 10 + cmd[2] - '0'];
+	m = verbs[vhash(cmd, vseed)];
+	return m && !strcmp(m->name, cmd) ? m : NULL;
+}
+
 /* XXX quick'n dirty implementation */
 int
 getkey(void) {
-	int key = readchar(), c;
+	int key = readchar(), c, x, y;
 
 	if(key != '\x1b' || readchar() != '[') {
 		switch(key) {
@@ -1044,44 +2132,90 @@ getkey(void) {
 	case '5': key = KeyPgUp; break;
 	case '6': key = KeyPgDw; break;
 	case '7': key = KeyHome; break;
-	case '8': key = KeyEnd; break;
+	case '8':
+		if((c = readchar()) != ';')
+			return KeyEnd;
+		/* "\x1b[8;rows;colst", the window size reported by frontend() */
+		for(y = 0; isdigit(c = readchar()); y = y * 10 + c - '0');
+		for(x = 0; isdigit(c = readchar()); x = x * 10 + c - '0');
+		if(x > 0 && y > 0) {
+			resize(y, x);
+			sel->need_redraw = REDRAW_ALL;
+		}
+		return KeyWinsize;
 	}
 	readchar();
 	return key;
 }
 
 void
-hangsup(void) {
-	if(!srv)
+hangsup(Network *n) {
+	SendLine *l;
+	int i;
+
+	if(!n->srv)
 		return;
-	fclose(srv);
-	srv = NULL;
-	online = 0;
+	for(i = 0; i < SendLast; ++i) {
+		while((l = n->sendq[i].head)) {
+			n->sendq[i].head = l->next;
+			free(l);
+		}
+		n->sendq[i].tail = NULL;
+		n->sendq[i].n = 0;
+	}
+	n->sendpart = NULL;
+	n->sendn = 0;
+	timerdel(&n->sendtimer);
+	timerdel(&n->keeptimer);
+	watch(&n->watch, -1, 0);
+	fclose(n->srv);
+	n->srv = NULL;
+	n->online = 0;
+	n->bufinlen = 0;
 	sel->need_redraw |= REDRAW_BAR;
 }
 
+/* Return the nth entry of the history of b, from the oldest. */
+char *
+histget(Buffer *b, int n) {
+	return &b->hist[b->histidx[(b->histfirst + n - 1) % histmax]];
+}
+
+char *
+histpath(Buffer *b) {
+	char *p;
+
+	if(!b->histpath && (p = storepath(b, storedir, ".hist"))) {
+		b->histpath = ecalloc(1, strlen(p) + 1);
+		strcpy(b->histpath, p);
+	}
+	return b->histpath;
+}
+
 void
 history(const Arg *arg) {
-	int nl, n, i;
+	int n;
 
-	if(!sel->histsz)
+	histload(sel);
+	if(!sel->histn)
 		return;
-	for(i = nl = 0; i < sel->histsz; i += strlen(&sel->hist[i]) + 2, ++nl);
 	if(!sel->histlnoff) {
-		if(sel->cmdlen)
-			histpush(sel->cmdbuf, sel->cmdlen);
-		sel->histlnoff = nl+1;
+		if(sel->cmdlen) {
+			histpush(sel, sel->cmdbuf, sel->cmdlen, 0);
+			sel->histlnoff = sel->histn;
+		}
+		else
+			sel->histlnoff = sel->histn + 1;
 	}
 	n = sel->histlnoff + arg->i;
 	if(n < 1)
 		n = 1;
-	else if(n > nl)
+	else if(n > sel->histn)
 		n = 0;
 	sel->histlnoff = n;
 	if(sel->histlnoff) {
-		for(i = 0; i < sel->histsz && --n; i += strlen(&sel->hist[i]) + 2);
-		sel->cmdlen = strlen(&sel->hist[i]);
-		memcpy(sel->cmdbuf, &sel->hist[i], sel->cmdlen);
+		sel->cmdlen = strlen(histget(sel, n));
+		memcpy(sel->cmdbuf, histget(sel, n), sel->cmdlen);
 	}
 	else {
 		sel->cmdlen = 0;
@@ -1091,394 +2225,1082 @@ history(const Arg *arg) {
 	sel->need_redraw |= REDRAW_CMDLN;
 }
 
+/* Load the saved history of b, the first time it is needed. The file is
+ * rewritten when it holds many more entries than what is kept. */
 void
-histpush(char *buf, int len) {
-	int nl, i;
+histload(Buffer *b) {
+	char buf[sizeof b->cmdbuf], *path;
+	FILE *fp;
+	int i, len, n = 0;
 
-	/* do not clone unchanged lines */
-	if(sel->histlnoff) {
-		for(i = 0, nl = 1; i < sel->histsz && nl != sel->histlnoff; i += strlen(&sel->hist[i]) + 2, ++nl);
-		if(!memcmp(&sel->hist[i], buf, len))
-			return;
+	if(b->histloaded)
+		return;
+	b->histloaded = 1;
+	b->hist = ecalloc(1, histbytes);
+	b->histidx = ecalloc(histmax, sizeof(int));
+	if(!(path = histpath(b)) || !(fp = fopen(path, "r")))
+		return;
+	while(fgets(buf, sizeof buf, fp)) {
+		len = strlen(buf);
+		if(len && buf[len - 1] == '\n')
+			buf[--len] = '\0';
+		if(len)
+			histpush(b, buf, len, 0);
+		++n;
+	}
+	fclose(fp);
+	if(n > 2 * histmax && (fp = fopen(path, "w"))) {
+		for(i = 1; i <= b->histn; ++i)
+			fprintf(fp, "%s\n", histget(b, i));
+		fclose(fp);
 	}
-	if(sel->histsz)
-		++sel->histsz;
-	i = sel->histsz;
-	if(!(sel->hist = realloc(sel->hist, (sel->histsz += len + 1))))
-		die("Cannot realloc");
-	memcpy(&sel->hist[i], buf, len);
-	sel->hist[i + len] = '\0';
 }
 
-int
-logfmt(char *fmt, ...) {
-	va_list ap;
-	int len;
+/* Append an entry to the history of b, dropping the oldest ones to make room
+ * for it. Entries are stored one after another in the ring, an entry which
+ * does not fit at the end starts over from the beginning. */
+void
+histpush(Buffer *b, char *buf, int len, int save) {
+	char *path;
+	FILE *fp;
+	int end, last;
 
-	if(!logp)
-		return -1;
-	va_start(ap, fmt);
-	len = vfprintf(logp, fmt, ap);
-	va_end(ap);
-	fflush(logp);
-	return len;
+	histload(b);
+	if(len >= histbytes)
+		return;
+	/* do not clone unchanged lines */
+	if(b->histlnoff && b->histlnoff <= b->histn
+	&& !strncmp(histget(b, b->histlnoff), buf, len) && !histget(b, b->histlnoff)[len])
+		return;
+	end = 0;
+	if(b->histn) {
+		last = b->histidx[(b->histfirst + b->histn - 1) % histmax];
+		end = last + strlen(&b->hist[last]) + 1;
+	}
+	if(end + len + 1 > histbytes) {
+		while(b->histn && b->histidx[b->histfirst] >= end) {
+			b->histfirst = (b->histfirst + 1) % histmax;
+			--b->histn;
+		}
+		end = 0;
+	}
+	while(b->histn && (b->histn == histmax
+	|| (b->histidx[b->histfirst] >= end && b->histidx[b->histfirst] <= end + len))) {
+		b->histfirst = (b->histfirst + 1) % histmax;
+		--b->histn;
+	}
+	memcpy(&b->hist[end], buf, len);
+	b->hist[end + len] = '\0';
+	b->histidx[(b->histfirst + b->histn++) % histmax] = end;
+	if(save && (path = histpath(b)) && (fp = fopen(path, "a"))) {
+		fprintf(fp, "%.*s\n", len, buf);
+		fclose(fp);
+	}
 }
 
 int
-mvprintf(int x, int y, char *fmt, ...) {
-	va_list ap;
-	int len;
-
-	printf(CURPOS, y, x);
-	va_start(ap, fmt);
-	len = vfprintf(stdout, fmt, ap);
-	va_end(ap);
-	return len;
-}
-
-Buffer *
-newbuf(char *name) {
-	Buffer *b;
-
-	b = ecalloc(1, sizeof(Buffer));
-	b->need_redraw = REDRAW_ALL;
-	strncpy(b->name, name, sizeof b->name);
-	attach(b);
-	return b;
+intable(const Interval *t, int n, unsigned int cp) {
+	int lo = 0, hi = n - 1, mid;
+
+	if(cp < t[0].first || cp > t[n - 1].last)
+		return 0;
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		if(cp < t[mid].first)
+			hi = mid - 1;
+		else if(cp > t[mid].last)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
 }
 
-Nick *
-nickadd(Buffer *b, char *name) {
-	Nick *n;
-
-	n = ecalloc(1, sizeof(Nick));
-	strncpy(n->name, name, sizeof n->name - 1);
-	n->len = strlen(n->name);
-
-	/* attach */
-	n->next = b->names;
-	b->names = n;
-	++b->totnames;
-	if(b == sel)
-		sel->need_redraw |= REDRAW_BAR;
-	return n;
+int
+ischan(Network *n, char *s) {
+	return *s && strchr(n->chantypes, *s);
 }
 
+/* Ping the server when it said nothing for two minutes, and give up on it
+ * when it did not answer for five. */
 void
-nickdel(Buffer *b, char *name) {
-	Nick *n, **tn;
+keepalive(void *arg) {
+	Network *n = arg;
+	Buffer *b;
 
-	if(!b)
+	if(!n->srv)
 		return;
-	if(!(n = nickget(b, name)))
-		return;
-	/* detach */
-	for(tn = &b->names; *tn && *tn != n; tn = &(*tn)->next);
-	*tn = n->next;
-	free(n);
-	--b->totnames;
-	if(b == sel)
-		sel->need_redraw |= REDRAW_BAR;
-}
-
-Nick *
-nickget(Buffer *b, char *name) {
-	Nick *n;
-
-	for(n = b->names; n; n = n->next)
-		if(!strcmp(n->name, name))
-			return n;
-	return NULL;
+	timerset(&n->keeptimer, mstime() + 120000);
+	if(now - n->trespond >= 300) {
+		hangsup(n);
+		for(b = buffers; b; b = b->next)
+			if(b->net == n)
+				bprintf_prefixed(b, "Connection timeout.\n");
+		retry(n);
+	}
+	else
+		sout(n, SendUrgent, "PING %s", n->host);
 }
 
+/* Start building a line of text, the time prefix first. Fragments are added
+ * with lnprintf() and the line is written by lncommit(), so that it is
+ * indexed and redrawn once. */
 void
-nicklist(Buffer *b, char *list) {
-	char *p, *np;
+lnbegin(void) {
+	if(!lnbuf) {
+		lnsz = 512;
+		lnbuf = ecalloc(1, lnsz);
+	}
+	lnlen = 0;
+	*lnbuf = '\0';
+	if(*prefix_format)
+		lnprintf("%s", timeprefix(msgtime));
+}
 
-	for(p = list, np = skip(list, ' '); *p; p = np, np = skip(np, ' ')) {
-		/* skip nick flags */
-		switch(*p) {
-		case '+':
-		case '@':
-		case '~':
-		case '%':
-		case '&':
-			++p;
-			break;
+/* Write the line to b. Lines longer than a segment of buffer text get split
+ * between words. */
+int
+lncommit(Buffer *b) {
+	char *s, *end = lnbuf + lnlen;
+	int n, len = 0;
+
+	for(s = lnbuf; s == lnbuf || s < end; s += n) {
+		n = end - s;
+		if(n > BUFSEG - 1) {
+			for(n = BUFSEG - 1; n > 0 && s[n] != ' '; --n);
+			if(!n)
+				n = BUFSEG - 1;
 		}
-		nickadd(b, p);
+		len += bprintf(b, "%.*s", n, s);
 	}
+	return len;
 }
 
 void
-nickmv(char *old, char *new) {
-	Buffer *b;
-	Nick *n;
+lnprintf(char *fmt, ...) {
+	va_list ap;
 
-	for(b = buffers; b; b = b->next) {
-		if(!(ISCHAN(b) && (n = nickget(b, old))))
-			continue;
-		strncpy(n->name, new, sizeof n->name - 1);
-		n->len = strlen(n->name);
-	}
+	va_start(ap, fmt);
+	lnvprintf(fmt, ap);
+	va_end(ap);
 }
 
 void
-parsecmd(char *cmd) {
-	char *p, *tp;
-	int i, len;
+lnvprintf(char *fmt, va_list ap) {
+	va_list ap2;
+	int len;
 
-	p = &cmd[1]; /* skip the slash */
-	if(!*p)
+	va_copy(ap2, ap);
+	len = vsnprintf(&lnbuf[lnlen], lnsz - lnlen, fmt, ap);
+	if(len < 0) {
+		va_end(ap2);
 		return;
-	tp = p + 1;
-	tp = skip(p, ' ');
-	len = strlen(p);
-	for(i = 0; i < LENGTH(commands); ++i) {
-		if(!strncmp(commands[i].name, p, len)) {
-			commands[i].func(p, tp);
-			return;
-		}
 	}
-	if(srv)
-		sout("%s %s", p, tp); /* raw */
-	else
-		bprintf_prefixed(sel, "/%s: not connected.\n", p);
+	if(lnlen + len >= lnsz) {
+		while(lnlen + len >= lnsz)
+			lnsz *= 2;
+		if(!(lnbuf = realloc(lnbuf, lnsz)))
+			die("realloc():");
+		vsnprintf(&lnbuf[lnlen], lnsz - lnlen, fmt, ap2);
+	}
+	va_end(ap2);
+	lnlen += len;
 }
 
+/* Stop the writer once it wrote everything. */
 void
-parsesrv(void) {
-	char *cmd, *usr, *par, *txt;
-
-#ifdef DEBUG
-	logfmt("%ld DEBUG parsesrv(): %s", time(NULL), bufin); /* \n is already there from fgets() */
-#endif
-	cmd = bufin;
-	usr = host;
-	if(!cmd || !*cmd)
-		return;
-	if(cmd[0] == ':') {
-		usr = cmd + 1;
-		cmd = skip(usr, ' ');
-		if(cmd[0] == '\0')
-			return;
-		skip(usr, '!');
-	}
-	skip(cmd, '\r');
-	par = skip(cmd, ' ');
-	txt = skip(par, ':');
-
-	trim(txt);
-	trim(par);
+logclose(void) {
+	uint64_t k = 1;
 
-	/* IRC formatting may be supported at some point in the future. For now
-	 * just strip that out to keep things simple. */
-	stripformats(txt);
+	if(!logq)
+		return;
+	logflush();
+	__atomic_store_n(&logstop, 1, __ATOMIC_RELEASE);
+	if(write(logfd, &k, sizeof k) == sizeof k)
+		pthread_join(logthread, NULL);
+	close(logfd);
+	free(logq);
+	logq = NULL;
+}
 
-	for(int i = 0; i < LENGTH(messages); ++i) {
-		if(!strcmp(messages[i].name, cmd)) {
-			if(messages[i].func)
-				messages[i].func(usr, par, txt);
-			return;
+/* Return the log file at path, opened for logwrite(). The least recently
+ * used one gets closed past LOGFILES. */
+LogFile *
+logfile(char *path) {
+	LogFile *f, **tf, **last = NULL;
+	struct stat st;
+	FILE *fp;
+	long t;
+	int n = 0;
+
+	for(tf = &logfiles; (f = *tf); tf = &f->next, ++n) {
+		if(!strcmp(f->path, path)) {
+			*tf = f->next;
+			f->next = logfiles;
+			logfiles = f;
+			return f;
 		}
+		last = tf;
+	}
+	if(n >= LOGFILES && last) {
+		f = *last;
+		*last = NULL;
+		if(f->fp)
+			fclose(f->fp);
+		free(f->path);
+		free(f);
+	}
+	if(!(fp = fopen(path, "a+")))
+		return NULL;
+	f = ecalloc(1, sizeof(LogFile));
+	f->path = ecalloc(1, strlen(path) + 1);
+	strcpy(f->path, path);
+	f->fp = fp;
+	f->since = time(NULL);
+	if(!fstat(fileno(fp), &st)) {
+		f->size = st.st_size;
+		/* the file is as old as its first line, which starts with its time */
+		f->since = st.st_size && fscanf(fp, "%ld", &t) == 1 ? t : st.st_mtime;
 	}
-	par = skip(par, ' ');
-	bprintf_prefixed(sel, "%s %s\n", par, txt);
+	fseek(fp, 0, SEEK_END); /* between reading and writing */
+	f->next = logfiles;
+	logfiles = f;
+	return f;
 }
 
+/* Wake the writer up if anything got queued, once per round of run(), and
+ * report the lines dropped since the last time. */
 void
-privmsg(char *to, char *txt) {
-	Buffer *b = getbuf(to);
-	
-	if(!b)
-		b = isalpha(*to) ? newbuf(to) : sel;
-	bprintf_prefixed(b, "%s: %s\n", nick, txt);
-	sout("PRIVMSG %s :%s", to, txt);
-	logfmt("%ld PRIVMSG to %s: %s\n", time(NULL), to, txt);
-}
+logflush(void) {
+	uint64_t k = 1;
 
-void
-quit(char *msg) {
-	if(!srv)
+	if(!logq)
 		return;
-	sout("QUIT :%s", msg);
-	hangsup();
+	if(logdrops != logdropsaid
+	&& logfmt(NULL, "%ld LOG dropped %lu lines\n", (long)now, logdrops - logdropsaid) >= 0)
+		logdropsaid = logdrops;
+	if(loghead == logkicked)
+		return;
+	logkicked = loghead;
+	if(write(logfd, &k, sizeof k) < 0)
+		return; /* written with the next ones */
 }
 
+/* Queue a line for the log of b, or for the main one when b is NULL. When
+ * logwrite() is that far behind that it does not fit, it is dropped. */
 int
-readchar(void) {
-	char buf[1] = {0};
-	return (read(0, buf, 1) < 1 ? EOF : buf[0]);
+logfmt(Buffer *b, char *fmt, ...) {
+	unsigned long h, t, off;
+	LogRec *r;
+	va_list ap;
+	char *path;
+	int len, plen, need;
+
+	if(!logq || !(path = b ? logpath(b) : logmain))
+		return -1;
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	plen = strlen(path);
+	need = (sizeof(LogRec) + plen + len + 2 + 7) & ~7;
+	h = loghead;
+	t = __atomic_load_n(&logtail, __ATOMIC_ACQUIRE);
+	off = h & (logqueue - 1);
+	if(off + need > logqueue)
+		h += logqueue - off; /* does not fit before the end */
+	if(len < 0 || h + need - t > logqueue) {
+		++logdrops;
+		return -1;
+	}
+	if(h != loghead)
+		((LogRec *)&logq[off])->len = 0;
+	r = (LogRec *)&logq[h & (logqueue - 1)];
+	r->len = need;
+	r->pathlen = plen;
+	r->textlen = len;
+	memcpy(r->s, path, plen + 1);
+	va_start(ap, fmt);
+	vsnprintf(&r->s[plen + 1], len + 1, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&loghead, h + need, __ATOMIC_RELEASE);
+	return len;
 }
 
+/* Start the writer, the lines are queued for it by logfmt(). */
 void
-recv_busynick(char *u, char *u2, char *u3) {
-	char *n = skip(u2, ' ');
+logopen(void) {
+	if(!*logdir)
+		return;
+	mkdir(logdir, 0700);
+	snprintf(logmain, sizeof logmain, "%s/circo.log", logdir);
+	logq = ecalloc(1, logqueue);
+	if((logfd = eventfd(0, EFD_CLOEXEC)) < 0)
+		die("eventfd():");
+	if(pthread_create(&logthread, NULL, logwrite, NULL))
+		die("cannot start the log writer");
+}
 
-	bprintf_prefixed(status, "%s is busy, choose a different /nick\n", n);
-	sel->need_redraw |= REDRAW_BAR;
+char *
+logpath(Buffer *b) {
+	char *p;
+
+	if(!b->logpath && (p = storepath(b, logdir, ".log"))) {
+		b->logpath = ecalloc(1, strlen(p) + 1);
+		strcpy(b->logpath, p);
+	}
+	return b->logpath;
 }
 
+/* Move f aside, its name gets the time it was rotated, archive it and
+ * start anew. */
 void
-recv_join(char *who, char *chan, char *txt) {
-	Buffer *b;
-
-	if(!*chan)
-		chan = txt;
-	b = getbuf(chan);
+logrotate(LogFile *f) {
+	char old[600], key[sizeof ((ArcBlock *)0)->buf];
+	long t = time(NULL);
+	int i, n;
+
+	fclose(f->fp);
+	snprintf(old, sizeof old, "%s.%ld", f->path, t);
+	for(i = 1; !access(old, F_OK); ++i)
+		snprintf(old, sizeof old, "%s.%ld.%d", f->path, t, i);
+	if(!rename(f->path, old)) {
+		/* the key is the path in logdir without ".log" */
+		n = strlen(f->path) - strlen(logdir) - 5;
+		snprintf(key, sizeof key, "%.*s", n, f->path + strlen(logdir) + 1);
+		arcadd(old, key);
+	}
+	f->fp = fopen(f->path, "a");
+	f->size = 0;
+	f->since = time(NULL);
+	f->dirty = 0;
+}
 
-	/* don't call nickadd() for ourselves since nicks list gets updated when join */
-	if(!strcmp(who, nick)) {
-		if(!b)
-			b = newbuf(chan);
-		else
-			b->kicked = 0; /* b may only be non-NULL due to this */
-		sel = b;
-		sel->need_redraw = REDRAW_ALL;
+/* The writer thread: write what logfmt() queued in batches, each file is
+ * flushed once per batch. */
+void *
+logwrite(void *arg) {
+	unsigned long h, t = 0;
+	LogFile *f;
+	LogRec *r;
+	uint64_t k;
+	time_t tnow;
+	int stop;
+
+	do {
+		if(read(logfd, &k, sizeof k) < 0 && errno != EINTR)
+			break;
+		stop = __atomic_load_n(&logstop, __ATOMIC_ACQUIRE);
+		h = __atomic_load_n(&loghead, __ATOMIC_ACQUIRE);
+		tnow = time(NULL);
+		while(t != h) {
+			r = (LogRec *)&logq[t & (logqueue - 1)];
+			if(!r->len) {
+				t += logqueue - (t & (logqueue - 1));
+				continue;
+			}
+			if((f = logfile(r->s)) && f->fp) {
+				fwrite(&r->s[r->pathlen + 1], 1, r->textlen, f->fp);
+				f->size += r->textlen;
+				f->dirty = 1;
+				if(f->size >= logsize || (logage && tnow - f->since >= logage))
+					logrotate(f);
+			}
+			t += r->len;
+			__atomic_store_n(&logtail, t, __ATOMIC_RELEASE);
+		}
+		for(f = logfiles; f; f = f->next) {
+			if(f->dirty && f->fp)
+				fflush(f->fp);
+			f->dirty = 0;
+		}
+	} while(!stop);
+	while((f = logfiles)) {
+		logfiles = f->next;
+		if(f->fp)
+			fclose(f->fp);
+		free(f->path);
+		free(f);
 	}
-	else
-		nickadd(b, who);
-	bprintf_prefixed(b, _C_"%s"_C_" %s\n", UI_WRAP("JOIN", IRCMessage), who);
-	logfmt("%ld JOIN %s on %s\n", time(NULL), who, chan);
+	return NULL;
 }
 
+/* A frontend attaches and takes over from the one before, if any. It is
+ * drawn the whole screen, again once it tells its size. */
 void
-recv_kick(char *oper, char *chan, char *who) {
-	Buffer *b;
+lsnin(Watch *w, int events) {
+	int fd;
 
-	who = skip(chan, ' ');
-	b = getbuf(chan);
-	if(!b)
+	if((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+	if(!peerok(fd)) {
+		close(fd);
 		return;
-	if(!strcmp(who, nick)) {
-		b->kicked = 1;
-		freenames(&b->names); /* we don't need this anymore */
-		bprintf_prefixed(b, "You got kicked from %s\n", chan);
 	}
-	else {
+	usrdrop();
+	watch(&usrwatch, fd, EPOLLIN | EPOLLRDHUP);
+	outfd = fd;
+	scrresize();
+	sel->need_redraw = REDRAW_ALL;
+}
+
+/* A small LZ77 codec for the scrollback. The compressed stream is a sequence
+ * of literal runs, a byte c < 0x80 followed by c + 1 bytes, and of matches, a
+ * byte 0x80 | (length - 4) followed by the 16 bits distance to copy from. */
+int
+lzpack(char *in, int len, char *out, int size) {
+	int tab[4096]; /* not static, the log writer packs too */
+	unsigned int h;
+	int i, lit, n, o, ref;
+
+	memset(tab, 0xff, sizeof tab);
+	for(i = lit = o = 0; i < len; ) {
+		n = ref = 0;
+		if(i + 4 <= len) {
+			h = (((unsigned char)in[i] | (unsigned char)in[i + 1] << 8
+			    | (unsigned char)in[i + 2] << 16 | (unsigned int)(unsigned char)in[i + 3] << 24)
+			    * 2654435761U) >> 20;
+			ref = tab[h];
+			tab[h] = i;
+			if(ref >= 0 && i - ref < 65536 && !memcmp(&in[ref], &in[i], 4))
+				for(n = 4; i + n < len && n < 131 && in[ref + n] == in[i + n]; ++n);
+		}
+		if(n < 4) {
+			++i;
+			if(++lit < 128 && i < len)
+				continue;
+		}
+		if(lit) {
+			if(o + 1 + lit > size)
+				return -1;
+			out[o++] = lit - 1;
+			memcpy(&out[o], &in[i - lit], lit);
+			o += lit;
+			lit = 0;
+		}
+		if(n >= 4) {
+			if(o + 3 > size)
+				return -1;
+			out[o++] = 0x80 | (n - 4);
+			out[o++] = (i - ref) >> 8;
+			out[o++] = (i - ref) & 0xff;
+			i += n;
+		}
+	}
+	return o;
+}
+
+int
+lzunpack(char *in, int len, char *out, int size) {
+	int c, i, n, o, d;
+
+	for(i = o = 0; i < len; ) {
+		c = (unsigned char)in[i++];
+		if(c < 0x80) {
+			n = c + 1;
+			if(i + n > len || o + n > size)
+				return -1;
+			memcpy(&out[o], &in[i], n);
+			i += n;
+			o += n;
+			continue;
+		}
+		n = (c & 0x7f) + 4;
+		if(i + 2 > len)
+			return -1;
+		d = (unsigned char)in[i] << 8 | (unsigned char)in[i + 1];
+		i += 2;
+		if(!d || d > o || o + n > size)
+			return -1;
+		for(; n; --n, ++o)
+			out[o] = out[o - d]; /* may overlap */
+	}
+	return o;
+}
+
+/* Keep the scrollback within scrollmem bytes by compressing the old segments
+ * of the buffers in background, then within scrollmax by dropping the oldest
+ * segments of the biggest buffers. The last segment of a buffer is never
+ * touched since it is being written. */
+void
+memtrim(void) {
+	Buffer *b, *big;
+	int i;
+
+	for(b = buffers; b && memres + memzip > scrollmem; b = b->next) {
+		if(b == sel)
+			continue;
+		for(i = b->segfirst; i < b->nsegs - 1 && memres + memzip > scrollmem; ++i)
+			if(b->segs[i].data && !b->segs[i].mapped)
+				segzip(b, i);
+	}
+	while(memres + memzip > scrollmax) {
+		big = NULL;
+		for(b = buffers; b; b = b->next)
+			if(b->segfirst < b->nsegs - 1
+			&& (!big || b->memres + b->memzip > big->memres + big->memzip))
+				big = b;
+		if(!big)
+			break;
+		segdrop(big);
+	}
+}
+
+long long
+mstime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Index messages[] for getmsg(). The seed of vhash() is searched until every
+ * command lands in its own slot of verbs[]. */
+void
+msgindex(void) {
+	Message *m;
+	unsigned int h;
+	int i;
+
+	for(vseed = 0;; ++vseed) {
+		if(vseed == 1 << 16)
+			die("cannot hash messages[], grow verbs[]");
+		memset(verbs, 0, sizeof verbs);
+		for(i = 0; i < LENGTH(messages); ++i) {
+			m = &messages[i];
+			if(isdigit(m->name[0])) {
+				numerics[atoi(m->name) % LENGTH(numerics)] = m;
+				continue;
+			}
+			h = vhash(m->name, vseed);
+			if(verbs[h])
+				break;
+			verbs[h] = m;
+		}
+		if(i == LENGTH(messages))
+			break;
+	}
+}
+
+Buffer *
+netbuf(Network *n) {
+	return sel->net == n ? sel : n->status;
+}
+
+char *
+netstate(Network *n) {
+	if(!(n->srv || n->lookup || n->dialing))
+		return "offline";
+	return n->online ? "online" : "connecting...";
+}
+
+Buffer *
+newbuf(Network *n, char *name) {
+	Buffer *b;
+
+	b = ecalloc(1, sizeof(Buffer));
+	b->lnidx = ecalloc(1, sizeof(int));
+	b->lnidxsz = 1;
+	b->lncols = cols;
+	b->need_redraw = REDRAW_ALL;
+	b->net = n;
+	strncpy(b->name, name, sizeof b->name - 1);
+	storeopen(b);
+	attach(b);
+	return b;
+}
+
+/* Add a network, not connected yet, along with its status buffer. */
+Network *
+newnet(char *h, char *p) {
+	Network *n, **tn;
+
+	n = ecalloc(1, sizeof(Network));
+	strncpy(n->host, h, sizeof n->host - 1);
+	strncpy(n->port, p, sizeof n->port - 1);
+	strncpy(n->nick, nick, sizeof n->nick - 1);
+	strcpy(n->chantypes, "#&");
+	strcpy(n->prefix, "~&@%+");
+	n->casemap = CaseRfc1459;
+	n->watch.func = srvio;
+	n->watch.fd = -1;
+	n->keeptimer.func = keepalive;
+	n->sendtimer.func = sendwatch;
+	n->retrytimer.func = reconnect;
+	n->dialtimer.func = dialnext;
+	n->watch.arg = n->keeptimer.arg = n->sendtimer.arg = n;
+	n->retrytimer.arg = n->dialtimer.arg = n;
+	for(tn = &networks; *tn; tn = &(*tn)->next);
+	*tn = n;
+	n->status = newbuf(n, "status");
+	return n;
+}
+
+Nick *
+nickadd(Buffer *b, char *name) {
+	Nick *n, *t;
+	User *u;
+	int i;
+
+	if((n = nickget(b, name)))
+		return n;
+	u = useradd(b->net, name);
+	n = nickalloc(b);
+	n->user = u;
+	n->buf = b;
+
+	/* attach */
+	n->next = b->names;
+	if(b->names)
+		b->names->prev = n;
+	b->names = n;
+	n->unext = u->chans;
+	u->chans = n;
+	++u->refs;
+	if(++b->totnames > b->nametabsz) {
+		free(b->nametab);
+		b->nametabsz = b->nametabsz ? b->nametabsz * 2 : 16;
+		b->nametab = ecalloc(b->nametabsz, sizeof(Nick *));
+		for(t = b->names; t; t = t->next) {
+			i = t->user->id & (b->nametabsz - 1);
+			t->hnext = b->nametab[i];
+			b->nametab[i] = t;
+		}
+	}
+	else {
+		i = u->id & (b->nametabsz - 1);
+		n->hnext = b->nametab[i];
+		b->nametab[i] = n;
+	}
+	if(b == sel)
+		sel->need_redraw |= REDRAW_BAR;
+	return n;
+}
+
+Nick *
+nickalloc(Buffer *b) {
+	NickSlab *sl;
+	Nick *n;
+
+	if((n = b->freenicks)) {
+		b->freenicks = n->next;
+		memset(n, 0, sizeof(Nick));
+		return n;
+	}
+	if(!b->slabs || b->slabs->used == b->slabs->size) {
+		sl = ecalloc(1, sizeof(NickSlab) + NICKSLAB(b->slabs) * sizeof(Nick));
+		sl->size = NICKSLAB(b->slabs);
+		sl->next = b->slabs;
+		b->slabs = sl;
+	}
+	return &b->slabs->nicks[b->slabs->used++];
+}
+
+void
+nickdel(Buffer *b, char *name) {
+	Nick *n, **tn;
+	User *u;
+
+	if(!b)
+		return;
+	if(!(n = nickget(b, name)))
+		return;
+	u = n->user;
+	/* detach */
+	if(n->prev)
+		n->prev->next = n->next;
+	else
+		b->names = n->next;
+	if(n->next)
+		n->next->prev = n->prev;
+	for(tn = &b->nametab[u->id & (b->nametabsz - 1)]; *tn != n; tn = &(*tn)->hnext);
+	*tn = n->hnext;
+	for(tn = &u->chans; *tn != n; tn = &(*tn)->unext);
+	*tn = n->unext;
+	n->next = b->freenicks;
+	b->freenicks = n;
+	if(!--u->refs)
+		userdel(b->net, u);
+	--b->totnames;
+	if(b == sel)
+		sel->need_redraw |= REDRAW_BAR;
+}
+
+Nick *
+nickget(Buffer *b, char *name) {
+	Nick *n;
+	User *u;
+
+	if(!b->nametabsz || !(u = userget(b->net, name)))
+		return NULL;
+	for(n = b->nametab[u->id & (b->nametabsz - 1)]; n; n = n->hnext)
+		if(n->user == u)
+			return n;
+	return NULL;
+}
+
+void
+nicklist(Buffer *b, char *list) {
+	char *p, *np;
+
+	for(p = list, np = skip(list, ' '); *p; p = np, np = skip(np, ' ')) {
+		/* skip nick flags */
+		while(*p && strchr(b->net->prefix, *p))
+			++p;
+		nickadd(b, p);
+	}
+}
+
+void
+outprintf(char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(&out[outlen], outsz - outlen, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return;
+	if(len >= outsz - outlen) {
+		outsz = (outsz + len) * 2;
+		if(!(out = realloc(out, outsz)))
+			die("realloc():");
+		va_start(ap, fmt);
+		vsnprintf(&out[outlen], outsz - outlen, fmt, ap);
+		va_end(ap);
+	}
+	outlen += len;
+}
+
+void
+parsecmd(char *cmd) {
+	char *p, *tp;
+	int i, len;
+
+	p = &cmd[1]; /* skip the slash */
+	if(!*p)
+		return;
+	tp = p + 1;
+	tp = skip(p, ' ');
+	len = strlen(p);
+	for(i = 0; i < LENGTH(commands); ++i) {
+		if(!strncmp(commands[i].name, p, len)) {
+			commands[i].func(p, tp);
+			return;
+		}
+	}
+	if(sel->net->srv)
+		sout(sel->net, SendText, "%s %s", p, tp); /* raw */
+	else
+		bprintf_prefixed(sel, "/%s: not connected.\n", p);
+}
+
+void
+parsesrv(Network *n, char *line) {
+	Message *msg;
+	Msg m;
+	int i;
+
+#ifdef DEBUG
+	logfmt(NULL, "%ld DEBUG parsesrv(): %s\n", (long)msgtime, line);
+#endif
+	if(tokenize(line, &m) < 0)
+		return;
+	if(!(msgtime = tagtime(&m.tags)))
+		msgtime = now;
+	if(!m.nick.len) {
+		m.nick.s = n->host;
+		m.nick.len = strlen(n->host);
+	}
+
+	/* IRC formatting may be supported at some point in the future. For now
+	 * just strip that out to keep things simple. */
+	if(m.npar) {
+		stripformats(m.par[m.npar - 1].s);
+		m.par[m.npar - 1].len = strlen(m.par[m.npar - 1].s);
+	}
+
+	if((msg = getmsg(m.cmd.s))) {
+		++msg->hits;
+		if(msg->func)
+			msg->func(n, &m);
+	}
+	else {
+		++unhandled;
+		/* skip the target, usually ourselves */
+		lnbegin();
+		for(i = 1; i < m.npar; ++i)
+			lnprintf(i > 1 ? " %s" : "%s", m.par[i].s);
+		lnprintf("\n");
+		lncommit(netbuf(n));
+	}
+	msgtime = now;
+}
+
+/* Return whether the other end of the socket fd is run by the same user. */
+int
+peerok(int fd) {
+	struct ucred cr;
+	socklen_t len = sizeof cr;
+
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) && cr.uid == getuid();
+}
+
+void
+privmsg(Network *n, char *to, char *txt) {
+	Buffer *b = getbuf(n, to);
+	
+	if(!b)
+		b = isalpha(*to) ? newbuf(n, to) : netbuf(n);
+	bprintf_prefixed(b, "%s: %s\n", n->nick, txt);
+	sout(n, SendText, "PRIVMSG %s :%s", to, txt);
+	logfmt(b, "%ld PRIVMSG to %s: %s\n", (long)msgtime, to, txt);
+}
+
+void
+quit(Network *n, char *msg) {
+	if(!n->srv)
+		return;
+	sout(n, SendUrgent, "QUIT :%s", msg);
+	sendflush(n, 1);
+	hangsup(n);
+}
+
+int
+readchar(void) {
+	char buf[1] = {0};
+	return (read(usrwatch.fd, buf, 1) < 1 ? EOF : buf[0]);
+}
+
+void
+reconnect(void *arg) {
+	Network *n = arg;
+
+	if(n->srv || n->lookup || n->dialing)
+		return;
+	dial(n);
+}
+
+void
+recv_busynick(Network *n, Msg *m) {
+	bprintf_prefixed(n->status, "%s is busy, choose a different /nick\n", m->par[1].s);
+	sel->need_redraw |= REDRAW_BAR;
+}
+
+/* Ask for server-time, the only capability used, see tagtime(). The
+ * registration waits for CAP END. */
+void
+recv_cap(Network *n, Msg *m) {
+	char *sub, *caps, *p;
+	int more;
+
+	if(m->npar < 3)
+		return;
+	sub = m->par[1].s;
+	caps = m->par[m->npar - 1].s;
+	more = m->npar > 3 && !strcmp(m->par[2].s, "*"); /* the list goes on */
+	if(!strcmp(sub, "LS")) {
+		for(p = caps; (p = strstr(p, "server-time")); p += 11)
+			if((p == caps || p[-1] == ' ') && (!p[11] || p[11] == ' ' || p[11] == '='))
+				break;
+		if(p && !n->capreq) {
+			n->capreq = 1;
+			sout(n, SendUrgent, "CAP REQ :server-time");
+		}
+		if(!more && !n->capreq)
+			sout(n, SendUrgent, "CAP END");
+	}
+	else if(n->capreq && (!strcmp(sub, "ACK") || !strcmp(sub, "NAK"))) {
+		n->capreq = 0;
+		sout(n, SendUrgent, "CAP END");
+	}
+}
+
+/* Keep what the server tells about itself and matters here. */
+void
+recv_isupport(Network *n, Msg *m) {
+	char *p, *v;
+	int i, map;
+
+	for(i = 1; i < m->npar - 1; ++i) {
+		p = m->par[i].s;
+		if(!strncmp(p, "CASEMAPPING=", 12)) {
+			v = p + 12;
+			map = !strcmp(v, "ascii") ? CaseAscii
+				: !strcmp(v, "strict-rfc1459") ? CaseStrict
+				: CaseRfc1459;
+			if(map != n->casemap) {
+				n->casemap = map;
+				rehash(n);
+			}
+		}
+		else if(!strncmp(p, "CHANTYPES=", 10))
+			strncpy(n->chantypes, p + 10, sizeof n->chantypes - 1);
+		else if(!strncmp(p, "PREFIX=", 7) && (v = strchr(p, ')')))
+			strncpy(n->prefix, v + 1, sizeof n->prefix - 1);
+	}
+}
+
+void
+recv_join(Network *n, Msg *m) {
+	char *who = m->nick.s, *chan = m->par[0].s;
+	Buffer *b = getbuf(n, chan);
+
+	/* don't call nickadd() for ourselves since nicks list gets updated when join */
+	if(!casecmp(n, who, n->nick)) {
+		if(!b)
+			b = newbuf(n, chan);
+		else
+			b->kicked = 0; /* b may only be non-NULL due to this */
+		sel = b;
+		sel->need_redraw = REDRAW_ALL;
+	}
+	else if(b)
+		nickadd(b, who);
+	bprintf_prefixed(b, _C_"%s"_C_" %s\n", UI_WRAP("JOIN", IRCMessage), who);
+	logfmt(b, "%ld JOIN %s on %s\n", (long)msgtime, who, chan);
+}
+
+void
+recv_kick(Network *n, Msg *m) {
+	char *oper = m->nick.s, *chan = m->par[0].s, *who = m->par[1].s;
+	Buffer *b = getbuf(n, chan);
+
+	if(!b)
+		return;
+	if(!casecmp(n, who, n->nick)) {
+		b->kicked = 1;
+		freenames(b); /* we don't need this anymore */
+		bprintf_prefixed(b, "You got kicked from %s\n", chan);
+	}
+	else {
 		bprintf_prefixed(b, _C_"%s"_C_" %s (%s)\n", UI_WRAP("KICK", IRCMessage), who, oper);
 		nickdel(b, who);
 	}
-	logfmt("%ld KICK %s on %s (%s)\n", time(NULL), who, chan, oper);
+	logfmt(b, "%ld KICK %s on %s (%s)\n", (long)msgtime, who, chan, oper);
 }
 
 void
-recv_luserme(char *host, char *mynick, char *info) {
-	strcpy(nick, mynick);
+recv_luserme(Network *n, Msg *m) {
+	strncpy(n->nick, m->par[0].s, sizeof n->nick - 1);
 	sel->need_redraw |= REDRAW_BAR;
 }
 
 void
-recv_mode(char *u, char *val, char *u2) {
-	if(*nick)
+recv_mode(Network *n, Msg *m) {
+	if(*n->nick)
 		return;
-	strcpy(nick, val);
+	strncpy(n->nick, m->par[0].s, sizeof n->nick - 1);
 	sel->need_redraw |= REDRAW_BAR;
 }
 
 void
-recv_motd(char *u, char *u2, char *txt) {
-	bprintf_prefixed(status, "%s\n", txt);
+recv_motd(Network *n, Msg *m) {
+	bprintf_prefixed(n->status, "%s\n", m->par[1].s);
 }
 
 void
-recv_names(char *host, char *par, char *names) {
-	char *chan = skip(skip(par, ' '), ' '); /* skip user and symbol */
-	Buffer *b = getbuf(chan);
+recv_names(Network *n, Msg *m) {
+	char *chan = m->par[2].s, *names = m->par[3].s;
+	Buffer *b = getbuf(n, chan);
 
 	if(!b)
-		b = status;
+		b = n->status;
 	if(!b->recvnames) {
-		freenames(&b->names);
-		b->totnames = 0;
+		freenames(b);
 		b->recvnames = 1;
 	}
 	nicklist(b, names); /* keep as last since names is altered by skip() */
 }
 
 void
-recv_namesend(char *host, char *par, char *names) {
-	char *chan = skip(par, ' ');
-	Buffer *b = getbuf(chan);
-	Nick *n;
+recv_namesend(Network *n, Msg *m) {
+	char *chan = m->par[1].s;
+	Buffer *b = getbuf(n, chan);
+	Nick *nk;
+	int mark;
 
 	if(!b)
-		b = status;
+		b = n->status;
 	b->recvnames = 0;
 	if(!b->totnames) {
-		bprintf_prefixed(sel, "No names in %s.\n", chan);
+		bprintf_prefixed(netbuf(n), "No names in %s.\n", chan);
 		return;
 	}
 
-	bprintf_prefixed(sel, _C_"%s"_C_" in %s (%d):", UI_WRAP("NAMES", IRCMessage), chan, b->totnames);
-	logfmt("%ld NAMES %s (%d):", time(NULL), chan, b->totnames);
-	for(n = b->names; n; n = n->next) {
-		bprintf(sel, " %s", n->name);
-		logfmt(" %s", n->name);
-	}
-	bprintf(sel, "\n");
-	logfmt("\n");
+	lnbegin();
+	lnprintf(_C_"%s"_C_" in %s (%d):", UI_WRAP("NAMES", IRCMessage), chan, b->totnames);
+	mark = lnlen;
+	for(nk = b->names; nk; nk = nk->next)
+		lnprintf(" %s", nk->user->name);
+	lnprintf("\n");
+	lncommit(netbuf(n));
+	logfmt(b, "%ld NAMES %s (%d):%s", (long)msgtime, chan, b->totnames, &lnbuf[mark]);
 }
 
 void
-recv_nick(char *who, char *u, char *upd) {
-	Buffer *b;
+recv_nick(Network *n, Msg *m) {
+	char *who = m->nick.s, *upd = m->par[0].s;
+	User *u;
+	Nick *nk;
 
-	if(!strcmp(who, nick)) {
-		strcpy(nick, upd);
+	if(!casecmp(n, who, n->nick)) {
+		strncpy(n->nick, upd, sizeof n->nick - 1);
 		sel->need_redraw |= REDRAW_BAR;
-		bprintf_prefixed(sel, "You're now known as %s\n", upd);
+		bprintf_prefixed(netbuf(n), "You're now known as %s\n", upd);
 	}
-	for(b = buffers; b; b = b->next) {
-		if(!(ISCHAN(b) && nickget(b, who)))
-			continue;
-		bprintf_prefixed(b, _C_"%s"_C_" %s is now %s\n", UI_WRAP("NICK", IRCMessage), who, upd);
+	if((u = userget(n, who))) {
+		for(nk = u->chans; nk; nk = nk->unext)
+			bprintf_prefixed(nk->buf, _C_"%s"_C_" %s is now %s\n", UI_WRAP("NICK", IRCMessage), who, upd);
+		usermv(n, u, upd);
 	}
-	nickmv(who, upd);
-	logfmt("%ld NICK %s is now %s\n", time(NULL), who, upd);
+	logfmt(n->status, "%ld NICK %s is now %s\n", (long)msgtime, who, upd);
 }
 
 void
-recv_notice(char *who, char *u, char *txt) {
-	bprintf_prefixed(sel, _C_"%s"_C_" %s: %s\n", UI_WRAP("NOTICE", IRCMessage), who, txt);
-	logfmt("%ld NOTICE %s: %s\n", time(NULL), who, txt);
+recv_notice(Network *n, Msg *m) {
+	char *who = m->nick.s, *txt = m->par[1].s;
+
+	bprintf_prefixed(netbuf(n), _C_"%s"_C_" %s: %s\n", UI_WRAP("NOTICE", IRCMessage), who, txt);
+	logfmt(n->status, "%ld NOTICE %s: %s\n", (long)msgtime, who, txt);
 }
 
 void
-recv_part(char *who, char *chan, char *txt) {
-	Buffer *b = getbuf(chan);
+recv_part(Network *n, Msg *m) {
+	char *who = m->nick.s, *chan = m->par[0].s, *txt = m->par[1].s;
+	Buffer *b = getbuf(n, chan);
 
 	/* cmd_close() destroy the buffer before PART is received */
 	if(!b)
 		return;
-	if(!strcmp(who, nick)) {
+	logfmt(b, "%ld PART %s from %s (%s)\n", (long)msgtime, who, chan, txt);
+	if(!casecmp(n, who, n->nick)) {
 		destroy(b);
 	}
 	else {
 		bprintf_prefixed(b, _C_"%s"_C_" %s (%s)\n", UI_WRAP("PART", IRCMessage), who, txt);
 		nickdel(b, who);
 	}
-	logfmt("%ld PART %s from %s (%s)\n", time(NULL), who, chan, txt);
 }
 
 void
-recv_ping(char *u, char *u2, char *txt) {
-	sout("PONG %s", txt);
+recv_ping(Network *n, Msg *m) {
+	sout(n, SendUrgent, "PONG %s", m->par[0].s);
 }
 
 void
-recv_privmsg(char *from, char *to, char *txt) {
+recv_privmsg(Network *n, Msg *m) {
+	char *from = m->nick.s, *to = m->par[0].s, *txt = m->par[1].s;
 	Buffer *b;
 	int mention, query;
 
-	query = !strcmp(nick, to);
-	mention = strstr(txt, nick) != NULL;
+	query = !casecmp(n, n->nick, to);
+	mention = strstr(txt, n->nick) != NULL;
 
 	if(query)
 		to = from;
-	b = getbuf(to);
+	b = getbuf(n, to);
 	if(!b)
-		b = newbuf(to);
+		b = newbuf(n, to);
 
 	if(b != sel && (mention || query)) {
 		++b->notify;
@@ -1488,183 +3310,612 @@ recv_privmsg(char *from, char *to, char *txt) {
 	}
 	bprintf_prefixed(b, _C_"%s"_C_": %s\n", UI_WRAP(from, mention ? NickMention : NickNormal), txt);
 	if(query)
-		logfmt("%ld PRIVMSG from %s on %s: %s\n", time(NULL), from, to, txt);
+		logfmt(b, "%ld PRIVMSG from %s on %s: %s\n", (long)msgtime, from, to, txt);
 	else
-		logfmt("%ld PRIVMSG from %s: %s\n", time(NULL), from, txt);
+		logfmt(b, "%ld PRIVMSG from %s: %s\n", (long)msgtime, from, txt);
 }
 
 void
-recv_quit(char *who, char *u, char *txt) {
-	Buffer *b;
-
-	for(b = buffers; b; b = b->next) {
-		if(!(ISCHAN(b) && nickget(b, who)))
-			continue;
-		bprintf_prefixed(b, _C_"%s"_C_" %s (%s)\n", UI_WRAP("QUIT", IRCMessage), who, txt);
-		nickdel(b, who);
+recv_quit(Network *n, Msg *m) {
+	char *who = m->nick.s, *txt = m->par[0].s;
+	User *u;
+	Nick *nk, *next;
+
+	if((u = userget(n, who))) {
+		for(nk = u->chans; nk; nk = next) {
+			next = nk->unext; /* the last nickdel() releases u */
+			bprintf_prefixed(nk->buf, _C_"%s"_C_" %s (%s)\n", UI_WRAP("QUIT", IRCMessage), who, txt);
+			nickdel(nk->buf, who);
+		}
 	}
-	logfmt("%ld QUIT %s (%s)\n", time(NULL), who, txt);
+	logfmt(n->status, "%ld QUIT %s (%s)\n", (long)msgtime, who, txt);
 }
 
 void
-recv_topic(char *who, char *chan, char *txt) {
-	bprintf_prefixed(getbuf(chan), "%s changed topic to %s\n", who, txt);
-	logfmt("%ld TOPIC %s (%s): %s\n", time(NULL), chan, who, txt);
+recv_topic(Network *n, Msg *m) {
+	char *who = m->nick.s, *chan = m->par[0].s, *txt = m->par[1].s;
+	Buffer *b = getbuf(n, chan);
+
+	bprintf_prefixed(b, "%s changed topic to %s\n", who, txt);
+	logfmt(b, "%ld TOPIC %s (%s): %s\n", (long)msgtime, chan, who, txt);
 }
 
 void
-recv_topicrpl(char *usr, char *par, char *txt) {
-	char *chan = skip(par, ' ');
+recv_topicrpl(Network *n, Msg *m) {
+	bprintf_prefixed(netbuf(n), "Topic on %s is %s\n", m->par[1].s, m->par[2].s); /* TODO: who set the topic? */
+}
 
-	bprintf_prefixed(sel, "Topic on %s is %s\n", chan, txt); /* TODO: who set the topic? */
+void
+recv_welcome(Network *n, Msg *m) {
+	n->retrywait = 0;
+	bprintf_prefixed(netbuf(n), "%s\n", m->par[1].s);
 }
 
+/* Hash again the buffers and the users of n, its casemapping changed. */
 void
-resize(int x, int y) {
+rehash(Network *n) {
 	Buffer *b;
+	User *u, *all = NULL;
+	int i;
 
-	rows = x;
-	cols = y;
+	if(n->buftabsz)
+		memset(n->buftab, 0, n->buftabsz * sizeof(Buffer *));
 	for(b = buffers; b; b = b->next) {
-		if(b->line && b->lnoff)
-			b->lnoff = bufinfo(b->data, b->len, b->line, LineToOffset);
-		b->nlines = bufinfo(b->data, b->len, 0, TotalLines);
+		if(b->net != n)
+			continue;
+		i = casehash(n, b->name) & (n->buftabsz - 1);
+		b->hnext = n->buftab[i];
+		n->buftab[i] = b;
+	}
+	for(i = 0; i < n->usertabsz; ++i) {
+		while((u = n->usertab[i])) {
+			n->usertab[i] = u->hnext;
+			u->hnext = all;
+			all = u;
+		}
+	}
+	while((u = all)) {
+		all = u->hnext;
+		i = casehash(n, u->name) & (n->usertabsz - 1);
+		u->hnext = n->usertab[i];
+		n->usertab[i] = u;
 	}
 }
 
+void
+resize(int x, int y) {
+	rows = x;
+	cols = y;
+	scrresize();
+	if(sel)
+		bufreflow(sel);
+}
+
+/* Look the server up, away from the event loop. */
+void *
+resolve(void *arg) {
+	struct addrinfo hints;
+	Lookup *lk = arg;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	lk->err = getaddrinfo(lk->host, lk->port, &hints, &lk->res);
+	if(write(dnsfd[1], &lk, sizeof lk) != sizeof lk)
+		die("write():");
+	return NULL;
+}
+
+/* Connect again later, waiting twice as long after each failed attempt. */
+void
+retry(Network *n) {
+	if(!reconnectmin)
+		return;
+	if(n->retrywait < reconnectmin)
+		n->retrywait = reconnectmin;
+	bprintf_prefixed(n->status, "Reconnecting in %d seconds.\n", n->retrywait);
+	timerset(&n->retrytimer, mstime() + n->retrywait * 1000LL);
+	n->retrywait = n->retrywait * 2 < reconnectmax ? n->retrywait * 2 : reconnectmax;
+}
+
 void
 run(void) {
-	Buffer *b;
-	struct timeval tv;
-	fd_set rd;
-	int n, nfds;
+	struct epoll_event ev[16];
+	Network *net;
+	Watch *w;
+	long long t;
+	int i, n;
 
 	while(running) {
-		FD_ZERO(&rd);
-		FD_SET(0, &rd);
-		tv.tv_sec = 120;
-		tv.tv_usec = 0;
-		nfds = 0;
-		if(srv) {
-			FD_SET(fileno(srv), &rd);
-			nfds = fileno(srv);
-		}
-		n = select(nfds + 1, &rd, 0, 0, &tv);
-		if(n < 0) {
-			if(errno == EINTR)
+		if(memcheck) {
+			memcheck = 0;
+			memtrim();
+		}
+		for(net = networks; net; net = net->next)
+			sendwatch(net);
+		/* coalesce the changes, typing is drawn by usrio() */
+		if(sel->need_redraw && outfd >= 0 && !drawtimer.prev)
+			timerset(&drawtimer, drawlast + 1000 / (maxfps ? maxfps : 1));
+		/* block until something happens when nothing is scheduled */
+		if((t = timernext()) >= 0 && (t -= mstime()) < 0)
+			t = 0;
+		n = epoll_wait(pollfd, ev, LENGTH(ev), t);
+		if(n < 0 && errno != EINTR)
+			die("epoll_wait():");
+		now = msgtime = time(NULL);
+		for(i = 0; i < n; ++i) {
+			w = ev[i].data.ptr;
+			w->func(w, ev[i].events);
+		}
+		timerrun(mstime());
+		storeflush();
+		logflush();
+	}
+}
+
+/* Blank the cells from x to the end of the line. */
+void
+scrclear(int x, int y) {
+	Cell *c;
+
+	if(y < 1 || y > rows || x < 1)
+		return;
+	if(x > 1 && x <= cols && !newscr[(y - 1) * cols + x - 1].g[0])
+		strcpy(newscr[(y - 1) * cols + x - 2].g, " ");
+	for(c = &newscr[(y - 1) * cols + x - 1]; x <= cols; ++x, ++c) {
+		strcpy(c->g, " ");
+		c->attr = -1;
+	}
+}
+
+/* Bring the terminal in sync with newscr. Only the cells which differ from
+ * curscr are sent, along with the minimal cursor motion and attributes
+ * changes, and everything goes out in a single write(2). */
+void
+scrflush(void) {
+	Cell *c, *o;
+	char sgr[64];
+	int x, y, i, n, dirty = 0, partial;
+
+	if(!(cols && rows))
+		return;
+	for(y = 1; y <= rows; ++y) {
+		for(x = 1; x <= cols; ++x) {
+			i = (y - 1) * cols + x - 1;
+			c = &newscr[i];
+			o = &curscr[i];
+			/* wide glyphs are only written whole, from their left half */
+			if(!CELLDIFF(c, o) && !(x < cols && !o[1].g[0] && CELLDIFF(&c[1], &o[1])))
+				continue;
+			if(!c->g[0])
+				continue;
+			if(!dirty++ && !outlen)
+				outprintf(CURSOFF);
+			if(termy != y || termx != x) {
+				if(termy == y && termx < x) {
+					/* rewriting a few unchanged cells is shorter */
+					for(n = termx; n < x && x - termx < 4; ++n)
+						if(newscr[i - x + n].attr != termattr || !newscr[i - x + n].g[0])
+							break;
+					if(n == x)
+						for(n = termx; n < x; ++n)
+							outprintf("%s", newscr[i - x + n].g);
+					else
+						outprintf(CURFWD, x - termx);
+				}
+				else if(x == 1 && (termy == y || termy == y - 1))
+					outprintf(termy == y ? "\r" : "\r\n");
+				else
+					outprintf(CURPOS, y, x);
+			}
+			if(c->attr != termattr) {
+				if(termattr != -1)
+					outprintf(COLRST);
+				if(c->attr != -1 && (n = uiset(sgr, c->attr)) > 0)
+					outprintf("%.*s", n, sgr);
+				termattr = c->attr;
+			}
+			outprintf("%s", c->g[0] ? c->g : " ");
+			*o = *c;
+			if(x < cols && !c[1].g[0]) {
+				o[1] = c[1];
+				++x;
+			}
+			termx = x + 1;
+			termy = y;
+			if(termx > cols)
+				termx = termy = -1; /* pending wrap, position unknown */
+		}
+	}
+	if(dirty || outlen || termy != rows || termx != sel->cmdpos) {
+		outprintf(CURPOS CURSON, rows, sel->cmdpos);
+		termx = sel->cmdpos;
+		termy = rows;
+	}
+	for(i = 0; i < outlen; i += n)
+		if((n = write(outfd, &out[i], outlen - i)) < 0 && errno != EINTR)
+			break;
+		else if(n < 0)
+			n = 0;
+	partial = i < outlen;
+	outlen = 0;
+	/* a frontend which cannot keep up is dropped, it can attach again */
+	if(partial && daemonize)
+		usrdrop();
+}
+
+void
+scroll(const Arg *arg) {
+	int bufh = rows - 2;
+
+	if(sel->nlines <= bufh)
+		return;
+	if(arg->i == 0) {
+		sel->line = 0;
+		sel->lnoff = 0;
+		sel->need_redraw |= (REDRAW_BUFFER | REDRAW_BAR);
+		return;
+	}
+	if(!sel->line)
+		sel->line = sel->nlines - bufh + 1;
+	sel->line += arg->i;
+	if(sel->line < 1)
+		sel->line = 1;
+	else if(sel->line > sel->nlines - bufh)
+		sel->line = 0;
+	sel->lnoff = bufinfo(sel, sel->line, LineToOffset);
+	sel->need_redraw |= (REDRAW_BUFFER | REDRAW_BAR);
+}
+
+/* Put the glyphs of the first len bytes of s on screen, starting at column x.
+ * Return the column right after the last glyph. */
+int
+scrput(int x, int y, char *s, int len) {
+	Cell *row, *c;
+	unsigned int cp;
+	char *e = s + len;
+	int nb, w, n;
+
+	if(y < 1 || y > rows || x < 1)
+		return x;
+	row = &newscr[(y - 1) * cols];
+	for(; s < e && *s; s += nb) {
+		nb = utf8decode(s, &cp);
+		w = cpwidth(cp);
+		if(w < 0 || s + nb > e)
+			continue;
+		if(!w) {
+			/* combine with the previous glyph */
+			if(x == 1)
+				continue;
+			c = &row[x - 2];
+			if(!c->g[0] && x > 2)
+				--c;
+			n = strlen(c->g);
+			if(n + nb < sizeof c->g) {
+				memcpy(&c->g[n], s, nb);
+				c->g[n + nb] = '\0';
+			}
+			continue;
+		}
+		if(x + w - 1 > cols)
+			break;
+		c = &row[x - 1];
+		/* do not leave half of a wide glyph around */
+		if(!c->g[0] && x > 1)
+			strcpy(c[-1].g, " ");
+		if(x + w - 1 < cols && !c[w].g[0])
+			strcpy(c[w].g, " ");
+		memcpy(c->g, s, nb);
+		c->g[nb] = '\0';
+		c->attr = drawattr;
+		if(w == 2) {
+			c[1].g[0] = '\0';
+			c[1].attr = drawattr;
+		}
+		x += w;
+	}
+	return x;
+}
+
+void
+scrresize(void) {
+	int i, n = rows * cols;
+
+	free(curscr);
+	free(newscr);
+	curscr = ecalloc(n ? n : 1, sizeof(Cell));
+	newscr = ecalloc(n ? n : 1, sizeof(Cell));
+	for(i = 0; i < n; ++i) {
+		strcpy(curscr[i].g, " ");
+		curscr[i].attr = -1;
+		newscr[i] = curscr[i];
+	}
+	/* the terminal gets cleared along with the next frame */
+	outprintf(CURSOFF COLRST CLEAR);
+	termattr = -1;
+	termx = termy = -1;
+	shown = NULL;
+}
+
+/* Scroll the lines from top to bot up by n, both on the terminal and in
+ * curscr, so that only the lines coming in need to be drawn. */
+void
+scrscroll(int top, int bot, int n) {
+	Cell *c;
+	int i;
+
+	if(n <= 0 || n > bot - top || top < 1 || bot > rows)
+		return;
+	outprintf(CURSOFF);
+	if(termattr != -1) {
+		outprintf(COLRST);
+		termattr = -1;
+	}
+	outprintf(SCROLLREG CURPOS, top, bot, bot, 1);
+	for(i = 0; i < n; ++i)
+		outprintf("\n");
+	outprintf(SCROLLRST);
+	memmove(&curscr[(top - 1) * cols], &curscr[(top - 1 + n) * cols],
+		(bot - top + 1 - n) * cols * sizeof(Cell));
+	for(c = &curscr[(bot - n) * cols]; c < &curscr[bot * cols]; ++c) {
+		strcpy(c->g, " ");
+		c->attr = -1;
+	}
+	termx = termy = -1;
+}
+
+/* Append a segment of text at data to b. */
+Segment *
+segadd(Buffer *b, char *data) {
+	Segment *sg;
+
+	if(b->nsegs == b->segssz) {
+		b->segssz = b->segssz ? b->segssz * 2 : 4;
+		if(!(b->segs = realloc(b->segs, b->segssz * sizeof(Segment))))
+			die("realloc():");
+	}
+	sg = &b->segs[b->nsegs++];
+	sg->data = data;
+	sg->z = NULL;
+	sg->len = sg->zlen = sg->mapped = 0;
+	return sg;
+}
+
+/* Drop the oldest segment of b along with the lines starting in it. */
+void
+segdrop(Buffer *b) {
+	Segment *sg = &b->segs[b->segfirst];
+	int base, j;
+
+	b->memres -= sg->data ? BUFSEG : 0;
+	b->memzip -= sg->zlen;
+	memres -= sg->data ? BUFSEG : 0;
+	memzip -= sg->zlen;
+	if(!sg->mapped)
+		free(sg->data);
+	free(sg->z);
+	sg->data = sg->z = NULL;
+	sg->len = sg->zlen = sg->mapped = 0;
+	base = ++b->segfirst * BUFSEG;
+	if(b == shown)
+		shown = NULL;
+	b->need_redraw |= REDRAW_BUFFER;
+	for(j = 0; j + 1 < b->nstamps && b->stamps[j + 1].off <= base; ++j);
+	if(b->nstamps && b->stamps[j].off < base)
+		b->stamps[j].off = base;
+	memmove(b->stamps, &b->stamps[j], (b->nstamps - j) * sizeof(Stamp));
+	b->nstamps -= j;
+	if(b->lnscan < base) {
+		b->lnscan = 0; /* reindex */
+		b->line = b->lnoff = 0;
+		return;
+	}
+	for(j = 0; j < b->nlines && b->lnidx[j] < base; ++j);
+	if(b->lnidx[j] < base)
+		b->lnidx[j] = base;
+	memmove(b->lnidx, &b->lnidx[j], (b->nlines - j + 1) * sizeof(int));
+	b->nlines -= j;
+	if(b->line && b->lnoff < base)
+		b->line = b->lnoff = 0;
+	else if(b->line)
+		b->line -= j;
+}
+
+void
+segzip(Buffer *b, int i) {
+	static char z[BUFSEG];
+	Segment *sg = &b->segs[i];
+	int n;
+
+	if((n = lzpack(sg->data, sg->len, z, sizeof z)) < 0)
+		return; /* incompressible, keep it */
+	sg->z = ecalloc(1, n ? n : 1);
+	memcpy(sg->z, z, n);
+	sg->zlen = n;
+	free(sg->data);
+	sg->data = NULL;
+	b->memres -= BUFSEG;
+	b->memzip += n;
+	memres -= BUFSEG;
+	memzip += n;
+}
+
+/* Write as many of the queued lines as the pacer allows, the most urgent
+ * first, with a single writev(2). A line written in part goes on before any
+ * other. With force the pacer is ignored. */
+void
+sendflush(Network *n, int force) {
+	struct iovec iov[64];
+	SendLine *l, *lines[LENGTH(iov)];
+	ssize_t w;
+	int i, nl = 0, p, tok;
+
+	if(!n->srv || !n->sendn)
+		return;
+	sendrefill(n);
+	if(n->sendpart) {
+		iov[nl].iov_base = n->sendpart->s + n->sendoff;
+		iov[nl].iov_len = n->sendpart->len - n->sendoff;
+		lines[nl++] = n->sendpart;
+	}
+	tok = force ? (int)LENGTH(iov) : n->sendtokens;
+	for(p = 0; p < SendLast && nl < LENGTH(iov) && tok > 0; ++p) {
+		for(l = n->sendq[p].head; l && nl < LENGTH(iov) && tok > 0; l = l->next) {
+			if(l == n->sendpart)
 				continue;
-			die("select()");
-		}
-		if(n == 0) {
-			if(srv) {
-				if(time(NULL) - trespond >= 300) {
-					hangsup();
-					for(b = buffers; b; b = b->next)
-						bprintf_prefixed(b, "Connection timeout.\n");
-				}
-				else
-					sout("PING %s", host);
-			}
-		}
-		else {
-			if(srv && FD_ISSET(fileno(srv), &rd)) {
-				/* TODO: we should keep reading until CRLF is found. Only at that
-				 * point parsesrv(), sendident(), etc. should be called. */
-				if(fgets(bufin, sizeof bufin, srv) == NULL) {
-					for(b = buffers; b; b = b->next)
-						bprintf_prefixed(b, "%s.\n", online
-							? "Remote host closed connection"
-							: "Cannot connect to the host");
-					hangsup();
-				}
-				else {
-					trespond = time(NULL);
-					parsesrv();
-					if(!online) {
-						online = 1;
-						sendident();
-					}
-				}
-			}
-			if(FD_ISSET(0, &rd))
-				usrin();
+			iov[nl].iov_base = l->s;
+			iov[nl].iov_len = l->len;
+			lines[nl++] = l;
+			--tok;
 		}
-		if(sel->need_redraw) {
-			draw();
-			sel->need_redraw = 0;
+	}
+	if(nl < n->sendn && tok <= 0)
+		++n->sendstalls;
+	if(!nl)
+		return;
+	w = writev(fileno(n->srv), iov, nl);
+	if(w < 0)
+		return; /* EAGAIN or a failure which the read side will see */
+	n->sentbytes += w;
+	for(i = 0; i < nl && w > 0; ++i) {
+		l = lines[i];
+		if(l != n->sendpart && n->sendtokens > 0)
+			--n->sendtokens;
+		if(w < iov[i].iov_len) {
+			n->sendoff = (l == n->sendpart ? n->sendoff : 0) + w;
+			n->sendpart = l;
+			break;
 		}
+		w -= iov[i].iov_len;
+		n->sendq[l->prio].head = l->next;
+		if(!l->next)
+			n->sendq[l->prio].tail = NULL;
+		--n->sendq[l->prio].n;
+		--n->sendn;
+		++n->sentlines;
+		if(l == n->sendpart)
+			n->sendpart = NULL;
+		free(l);
 	}
 }
 
 void
-scroll(const Arg *arg) {
-	int bufh = rows - 2;
+sendident(Network *n) {
+	n->capreq = 0;
+	sout(n, SendUrgent, "CAP LS 302"); /* see recv_cap() */
+	sout(n, SendUrgent, "NICK %s", n->nick);
+	sout(n, SendUrgent, "USER %s localhost %s :%s", n->nick, n->host, n->nick);
+}
 
-	if(sel->nlines <= bufh)
-		return;
-	if(arg->i == 0) {
-		sel->line = 0;
-		sel->lnoff = 0;
-		sel->need_redraw |= (REDRAW_BUFFER | REDRAW_BAR);
+/* Token bucket: one more line can go out every sendms milliseconds, up to
+ * sendburst of them at once. */
+void
+sendrefill(Network *n) {
+	long long t = mstime(), k;
+
+	if(n->sendtokens >= sendburst) {
+		n->sendlast = t;
 		return;
 	}
-	if(!sel->line)
-		sel->line = sel->nlines - bufh + 1;
-	sel->line += arg->i;
-	if(sel->line < 1)
-		sel->line = 1;
-	else if(sel->line > sel->nlines - bufh)
-		sel->line = 0;
-	sel->lnoff = bufinfo(sel->data, sel->len, sel->line, LineToOffset);
-	sel->need_redraw |= (REDRAW_BUFFER | REDRAW_BAR);
+	k = (t - n->sendlast) / sendms;
+	n->sendtokens += k;
+	n->sendlast += k * sendms;
+	if(n->sendtokens >= sendburst) {
+		n->sendtokens = sendburst;
+		n->sendlast = t;
+	}
 }
 
+/* Have the socket polled for writing only when the pacer lets a line go
+ * out, else wait for it with sendtimer. */
 void
-sendident(void) {
-	sout("NICK %s", nick);
-	sout("USER %s localhost %s :%s", nick, host, nick);
+sendwatch(void *arg) {
+	Network *n = arg;
+	int events = EPOLLIN;
+
+	if(!n->srv)
+		return;
+	if(n->sendn) {
+		sendrefill(n);
+		if(n->sendpart || n->sendtokens > 0)
+			events |= EPOLLOUT;
+		else if(!n->sendtimer.prev)
+			timerset(&n->sendtimer, n->sendlast + sendms);
+	}
+	watch(&n->watch, fileno(n->srv), events);
 }
 
 void
 setup(void) {
-	struct termios ti;
-	struct sigaction sa;
+	struct sockaddr_un sa = { AF_UNIX };
 	struct winsize ws;
+	sigset_t sigs;
+	mode_t mask;
+	int fd;
 
-	/* clean up any zombies immediately */
-	sigchld(0);
+	msgindex();
+	now = msgtime = time(NULL);
 
 	setlocale(LC_CTYPE, "");
-	sa.sa_flags = 0;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_handler = sigwinch;
-	sigaction(SIGWINCH, &sa, NULL);
-	tcgetattr(0, &origti);
-	cfmakeraw(&ti);
-	ti.c_iflag |= ICRNL;
-	ti.c_cc[VMIN] = 0;
-	ti.c_cc[VTIME] = 0;
-	tcsetattr(0, TCSAFLUSH, &ti);
+	/* signals are read from a signalfd(2) in run() */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	if((pollfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1():");
+	if((fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		die("signalfd():");
+	watch(&sigwatch, fd, EPOLLIN);
+	if(pipe2(dnsfd, O_CLOEXEC) < 0)
+		die("pipe2():");
+	watch(&dnswatch, dnsfd[0], EPOLLIN);
+	/* clean up any zombies immediately */
+	while(0 < waitpid(-1, NULL, WNOHANG));
+	wheelnow = mstime();
+	if(daemonize) {
+		strncpy(sa.sun_path, sockpath, sizeof sa.sun_path - 1);
+		if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			die("socket():");
+		if(!connect(fd, (struct sockaddr *)&sa, sizeof sa))
+			die("%s: in use by another circo", sockpath);
+		close(fd);
+		unlink(sockpath); /* left by a daemon which died */
+		if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+			die("socket():");
+		mask = umask(077); /* nobody else may connect, not even for a while */
+		if(bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(fd, 4) < 0)
+			die("%s:", sockpath);
+		umask(mask);
+		watch(&lsnwatch, fd, EPOLLIN);
+		signal(SIGPIPE, SIG_IGN);
+		outfd = -1;
+		resize(24, 80); /* until a frontend tells its size */
+		return;
+	}
+	watch(&usrwatch, 0, EPOLLIN);
+	ttyraw();
 	ioctl(0, TIOCGWINSZ, &ws);
 	resize(ws.ws_row, ws.ws_col);
 }
 
 void
-sigchld(int unused) {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		die("can't install SIGCHLD handler:");
-	while(0 < waitpid(-1, NULL, WNOHANG));
-}
-
-void
-sigwinch(int unused) {
+sigin(Watch *w, int events) {
+	struct signalfd_siginfo si;
 	struct winsize ws;
 
-	ioctl(0, TIOCGWINSZ, &ws);
-	resize(ws.ws_row, ws.ws_col);
-	sel->need_redraw = REDRAW_ALL;
-	printf(CLEAR);
-	draw();
+	while(read(sigwatch.fd, &si, sizeof si) == sizeof si) {
+		if(si.ssi_signo == SIGCHLD) {
+			while(0 < waitpid(-1, NULL, WNOHANG));
+		}
+		else if(si.ssi_signo == SIGWINCH && !daemonize) {
+			ioctl(0, TIOCGWINSZ, &ws);
+			resize(ws.ws_row, ws.ws_col);
+			sel->need_redraw = REDRAW_ALL;
+		}
+	}
 }
 
 char *
@@ -1676,22 +3927,121 @@ skip(char *s, char c) {
 	return s;
 }
 
+/* Put sockpath in $XDG_RUNTIME_DIR, or else in /tmp/circo-$UID which has to
+ * be a directory of the user nobody else can enter. */
+void
+sockfind(void) {
+	char dir[64], *xdg = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+
+	if(xdg && *xdg) {
+		snprintf(sockpath, sizeof sockpath, "%s/%s", xdg, sockname);
+		return;
+	}
+	snprintf(dir, sizeof dir, "/tmp/circo-%u", (unsigned int)getuid());
+	if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+		die("%s:", dir);
+	if(lstat(dir, &st) < 0)
+		die("%s:", dir);
+	if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || st.st_mode & 077)
+		die("%s: not a private directory", dir);
+	snprintf(sockpath, sizeof sockpath, "%s/%s", dir, sockname);
+}
+
+/* Queue a line for the server, see sendflush(). */
 void
-sout(char *fmt, ...) {
+sout(Network *n, int prio, char *fmt, ...) {
+	SendLine *l;
 	va_list ap;
+	int len;
 
 	va_start(ap, fmt);
-	vsnprintf(bufout, sizeof bufout, fmt, ap);
+	len = vsnprintf(bufout, sizeof bufout - 2, fmt, ap);
 	va_end(ap);
-	fprintf(srv, "%s\r\n", bufout);
+	if(len > sizeof bufout - 3)
+		len = sizeof bufout - 3;
+	l = ecalloc(1, sizeof(SendLine) + len + 2);
+	l->prio = prio;
+	l->len = len + 2;
+	memcpy(l->s, bufout, len);
+	memcpy(l->s + len, "\r\n", 2);
+	if(n->sendq[prio].tail)
+		n->sendq[prio].tail->next = l;
+	else
+		n->sendq[prio].head = l;
+	n->sendq[prio].tail = l;
+	if(++n->sendq[prio].n > n->sendq[prio].max)
+		n->sendq[prio].max = n->sendq[prio].n;
+	++n->sendn;
 #ifdef DEBUG
-	logfmt("%ld DEBUG sout() %s\n", time(NULL), bufout);
+	logfmt(NULL, "%ld DEBUG sout() %s\n", (long)msgtime, bufout);
 #endif
 }
 
+/* Read what the server sent and parse every complete line of it. A partial
+ * line is kept at the start of bufin until the rest of it comes in. */
+void
+srvin(Network *n) {
+	Buffer *b;
+	char *l, *e;
+	int len;
+
+	len = read(fileno(n->srv), &n->bufin[n->bufinlen], sizeof n->bufin - 1 - n->bufinlen);
+	if(len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(len <= 0) {
+		for(b = buffers; b; b = b->next)
+			if(b->net == n)
+				bprintf_prefixed(b, "%s.\n", n->online
+					? "Remote host closed connection"
+					: "Cannot connect to the host");
+		hangsup(n);
+		retry(n);
+		return;
+	}
+	n->trespond = time(NULL);
+	timerset(&n->keeptimer, mstime() + 120000);
+	n->bufinlen += len;
+	for(l = n->bufin; n->srv && (e = memchr(l, '\n', &n->bufin[n->bufinlen] - l)); l = e + 1) {
+		*e = '\0';
+		if(e > l && e[-1] == '\r')
+			e[-1] = '\0';
+		parsesrv(n, l);
+		if(n->srv && !n->online) {
+			n->online = 1;
+			sendident(n);
+		}
+	}
+	if(!n->srv)
+		return;
+	n->bufinlen -= l - n->bufin;
+	memmove(n->bufin, l, n->bufinlen);
+	/* no room left for the end of the line, take it as it is */
+	if(n->bufinlen == sizeof n->bufin - 1) {
+		n->bufin[n->bufinlen] = '\0';
+		parsesrv(n, n->bufin);
+		n->bufinlen = 0;
+	}
+}
+
+void
+srvio(Watch *w, int events) {
+	Network *n = w->arg;
+
+	if(n->srv && events & EPOLLOUT)
+		sendflush(n, 0);
+	if(n->srv && events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		srvin(n);
+}
+
 void
 spawn(const char **cmd) {
+	sigset_t sigs;
+
 	if(fork() == 0) {
+		sigemptyset(&sigs);
+		sigprocmask(SIG_SETMASK, &sigs, NULL);
+		signal(SIGPIPE, SIG_DFL);
 		setsid();
 		execvp(cmd[0], (char **)cmd);
 		fprintf(stderr, "%s: execvp %s", argv0, cmd[0]);
@@ -1700,6 +4050,173 @@ spawn(const char **cmd) {
 	}
 }
 
+/* Close the store files of b, they are opened again by storeput(). */
+void
+storeclose(Buffer *b) {
+	Buffer **tb;
+
+	if(!b->store)
+		return;
+	fclose(b->store);
+	fclose(b->storeidx);
+	b->store = b->storeidx = NULL;
+	b->storedirty = 0;
+	for(tb = &stores; *tb && *tb != b; tb = &(*tb)->snext);
+	if(*tb)
+		*tb = b->snext;
+}
+
+/* Open the store files of b for storeput(). The least recently written
+ * ones get closed past STOREFILES. */
+int
+storefiles(Buffer *b) {
+	Buffer *s, **ts, **last = NULL;
+	struct stat st;
+	char *path;
+	int n = 0;
+
+	for(ts = &stores; (s = *ts); ts = &s->snext, ++n) {
+		if(s == b) {
+			*ts = s->snext;
+			s->snext = stores;
+			stores = s;
+			return 0;
+		}
+		last = ts;
+	}
+	if(n >= STOREFILES && last)
+		storeclose(*last);
+	if(!(path = storepath(b, storedir, "")) || !(b->store = fopen(path, "a")))
+		return -1;
+	if(!(b->storeidx = fopen(storepath(b, storedir, ".idx"), "a"))) {
+		fclose(b->store);
+		b->store = NULL;
+		return -1;
+	}
+	if(!fstat(fileno(b->store), &st))
+		b->storeoff = st.st_size; /* another file after a change of host */
+	b->snext = stores;
+	stores = b;
+	return 0;
+}
+
+/* Flush the stores written since the last time, once per round of run(). */
+void
+storeflush(void) {
+	Buffer *b;
+
+	if(!storedirty)
+		return;
+	for(b = stores; b; b = b->snext) {
+		if(!b->storedirty)
+			continue;
+		fflush(b->store);
+		fflush(b->storeidx);
+		b->storedirty = 0;
+	}
+	storedirty = 0;
+}
+
+/* Attach the last storelines lines of the store in fp, indexed in ifp. The
+ * text is mapped and split in segments at line boundaries, nothing is read
+ * until it gets displayed. */
+void
+storemap(Buffer *b, FILE *fp, FILE *ifp) {
+	struct stat st, ist;
+	StoreLine *idx;
+	long i, nl, s, e;
+	Segment *sg;
+
+	if(fstat(fileno(fp), &st) || fstat(fileno(ifp), &ist))
+		return;
+	b->storeon = 1;
+	b->storeoff = st.st_size;
+	nl = ist.st_size / sizeof(StoreLine);
+	if(!st.st_size || !nl || !storelines)
+		return;
+	idx = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fileno(ifp), 0);
+	if(idx == MAP_FAILED)
+		return;
+	b->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if(b->map == MAP_FAILED) {
+		b->map = NULL;
+		munmap(idx, ist.st_size);
+		return;
+	}
+	b->mapsz = st.st_size;
+	while(nl && idx[nl - 1].end > st.st_size)
+		--nl; /* the text did not make it to the disk */
+	i = nl > storelines ? nl - storelines : 0;
+	for(s = i ? idx[i - 1].end : 0; i < nl; s = e) {
+		sg = segadd(b, &b->map[s]);
+		sg->mapped = 1;
+		for(e = s; i < nl && (idx[i].end - s < BUFSEG || e == s); e = idx[i++].end)
+			bufstamp(b, (b->nsegs - 1) * BUFSEG + e - s, idx[i].t);
+		sg->len = e - s < BUFSEG ? e - s : BUFSEG - 1; /* a longer line is cut */
+	}
+	munmap(idx, ist.st_size);
+	if(b->nsegs) {
+		b->len = (b->nsegs - 1) * BUFSEG + b->segs[b->nsegs - 1].len;
+		b->lncols = 0; /* index it when shown */
+	}
+}
+
+/* Open the scrollback store of b and attach its last lines. The files are
+ * only kept open while written, see storefiles(). */
+void
+storeopen(Buffer *b) {
+	FILE *fp, *ifp;
+	char *path;
+
+	if(!(path = storepath(b, storedir, "")) || !(fp = fopen(path, "a+")))
+		return;
+	if((ifp = fopen(storepath(b, storedir, ".idx"), "a+"))) {
+		storemap(b, fp, ifp);
+		fclose(ifp);
+	}
+	fclose(fp); /* the mappings stay */
+}
+
+/* Return the path of the file of b with the given extension in the store,
+ * NULL if there is no store. */
+char *
+storepath(Buffer *b, char *dir, char *ext) {
+	static char path[512];
+	char name[sizeof b->name];
+	int n;
+
+	if(!*dir)
+		return NULL;
+	for(n = 0; b->name[n]; ++n)
+		name[n] = b->name[n] == '/' ? '_' : CASEMAP((unsigned char)b->name[n], CaseRfc1459);
+	name[n] = '\0';
+	mkdir(dir, 0700);
+	snprintf(path, sizeof path, "%s/%s", dir, b->net->host);
+	mkdir(path, 0700);
+	snprintf(path, sizeof path, "%s/%s/%s%s", dir, b->net->host, name, ext);
+	return path;
+}
+
+/* Append len bytes of text to the store of b and index its lines. */
+void
+storeput(Buffer *b, char *s, int len) {
+	StoreLine ln;
+	char *p, *end = s + len;
+
+	if(storefiles(b) < 0) {
+		b->storeon = 0; /* the index would not match the text anymore */
+		return;
+	}
+	b->storedirty = storedirty = 1;
+	fwrite(s, 1, len, b->store);
+	ln.t = msgtime;
+	for(p = s; (p = memchr(p, '\n', end - p)); ) {
+		ln.end = b->storeoff + (++p - s);
+		fwrite(&ln, sizeof ln, 1, b->storeidx);
+	}
+	b->storeoff += len;
+}
+
 /* https://modern.ircdocs.horse/formatting.html */
 void
 stripformats(char *s) {
@@ -1730,6 +4247,209 @@ stripformats(char *s) {
 	*s++ = *p;
 }
 
+/* Return the time of an IRCv3 server-time tag, 0 if there is none. */
+time_t
+tagtime(Str *tags) {
+	struct tm tm;
+	char *p;
+
+	for(p = tags->s; p && *p; p = strchr(p, ';'), p = p ? p + 1 : NULL) {
+		if(strncmp(p, "time=", 5))
+			continue;
+		memset(&tm, 0, sizeof tm);
+		if(sscanf(p + 5, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+			return 0;
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		return timegm(&tm);
+	}
+	return 0;
+}
+
+/* Render prefix_format at t. The result is reused within the same second,
+ * or the same minute if the format shows no seconds. */
+char *
+timeprefix(time_t t) {
+	static char buf[64];
+	static time_t last = -1;
+	static int step;
+	char *p;
+	int len;
+
+	if(!step) {
+		step = 60;
+		for(p = prefix_format; (p = strchr(p, '%')) && p[1]; p += 2)
+			if(strchr("STsrXc+", p[1]))
+				step = 1;
+	}
+	if(last == t - t % step)
+		return buf;
+	last = t - t % step;
+	len = strftime(buf, sizeof buf, prefix_format, localtime(&t));
+	if(!len)
+		len = strftime(buf, sizeof buf, "%T | ", localtime(&t)); /* fallback */
+	buf[len] = '\0';
+	return buf;
+}
+
+void
+timerdel(Timer *t) {
+	if(!t->prev)
+		return;
+	*t->prev = t->next;
+	if(t->next)
+		t->next->prev = t->prev;
+	t->prev = NULL;
+	--wheeln[t->level];
+}
+
+/* Return when the next timer is due, -1 if none is pending. Only the first
+ * non-empty slot of each level has to be looked at. */
+long long
+timernext(void) {
+	Timer *t;
+	long long next = -1;
+	int i, l, s;
+
+	for(l = 0; l < WHEELLVLS; ++l) {
+		if(!wheeln[l])
+			continue;
+		/* the current slot of an upper level was spread already, unless
+		 * the level below is about to wrap */
+		s = SLOT(wheelnow, l);
+		if(l && wheelnow & ((1LL << WHEELBITS * l) - 1))
+			++s;
+		for(i = 0; !wheel[l][(s + i) & (WHEELSZ - 1)]; ++i);
+		for(t = wheel[l][(s + i) & (WHEELSZ - 1)]; t; t = t->next)
+			if(next < 0 || t->when < next)
+				next = t->when;
+	}
+	return next;
+}
+
+/* Fire the timers due up to the time t. Each time a level wraps, the next
+ * slot of the level above is spread on the levels below. */
+void
+timerrun(long long t) {
+	Timer *tm;
+	long long skip;
+	int l, s;
+
+	while(wheelnow <= t) {
+		/* nothing happens before the lowest non-empty level moves */
+		for(l = 0, skip = 0; l < WHEELLVLS && !wheeln[l]; ++l)
+			skip = skip << WHEELBITS | (WHEELSZ - 1);
+		if(l == WHEELLVLS) {
+			wheelnow = t + 1;
+			break;
+		}
+		if(wheelnow & skip) {
+			wheelnow = (wheelnow | skip) + 1 < t + 1 ? (wheelnow | skip) + 1 : t + 1;
+			continue;
+		}
+		for(l = 1; l < WHEELLVLS && !SLOT(wheelnow, l - 1); ++l) {
+			s = SLOT(wheelnow, l);
+			while((tm = wheel[l][s]))
+				timerset(tm, tm->when);
+		}
+		s = SLOT(wheelnow, 0);
+		++wheelnow;
+		while((tm = wheel[0][s])) {
+			timerdel(tm);
+			tm->func(tm->arg);
+		}
+	}
+}
+
+/* Have t fire at the time when, as given by mstime(). A timer goes on the
+ * lowest level of the wheel whose span holds it. */
+void
+timerset(Timer *t, long long when) {
+	Timer **slot;
+	long long at, d;
+	int l;
+
+	timerdel(t);
+	t->when = when;
+	at = when > wheelnow ? when : wheelnow;
+	d = at - wheelnow;
+	for(l = 0; l < WHEELLVLS - 1 && d >> WHEELBITS * (l + 1); ++l);
+	if(d >> WHEELBITS * WHEELLVLS)
+		at = wheelnow + (1LL << WHEELBITS * WHEELLVLS) - 1; /* spread again later */
+	slot = &wheel[l][SLOT(at, l)];
+	t->level = l;
+	t->prev = slot;
+	t->next = *slot;
+	if(t->next)
+		t->next->prev = &t->next;
+	*slot = t;
+	++wheeln[l];
+}
+
+/* Split s, which is modified, in its tags, source, command and parameters.
+ * Return -1 if there is no command. */
+int
+tokenize(char *s, Msg *m) {
+	Str *p;
+	char *c;
+	int i;
+
+	m->tags.s = m->nick.s = m->user.s = m->host.s = m->cmd.s = "";
+	m->tags.len = m->nick.len = m->user.len = m->host.len = m->cmd.len = 0;
+	for(i = 0; i < LENGTH(m->par); ++i) {
+		m->par[i].s = "";
+		m->par[i].len = 0;
+	}
+	m->npar = 0;
+
+	if(*s == '@')
+		s = token(s + 1, &m->tags);
+	if(*s == ':') {
+		s = token(s + 1, &m->nick);
+		if((c = memchr(m->nick.s, '@', m->nick.len))) {
+			*c++ = '\0';
+			m->host.s = c;
+			m->host.len = m->nick.len - (c - m->nick.s);
+			m->nick.len = c - 1 - m->nick.s;
+		}
+		if((c = memchr(m->nick.s, '!', m->nick.len))) {
+			*c++ = '\0';
+			m->user.s = c;
+			m->user.len = m->nick.len - (c - m->nick.s);
+			m->nick.len = c - 1 - m->nick.s;
+		}
+	}
+	s = token(s, &m->cmd);
+	if(!m->cmd.len)
+		return -1;
+	while(*s && m->npar < LENGTH(m->par)) {
+		p = &m->par[m->npar++];
+		/* the trailing parameter takes the rest of the line */
+		if(*s == ':' || m->npar == LENGTH(m->par)) {
+			p->s = s + (*s == ':');
+			p->len = strlen(p->s);
+			break;
+		}
+		s = token(s, p);
+	}
+	return 0;
+}
+
+/* Terminate the token at s and return the next one. */
+char *
+token(char *s, Str *t) {
+	t->s = s;
+	while(*s && *s != ' ')
+		++s;
+	t->len = s - t->s;
+	if(*s)
+		*s++ = '\0';
+	while(*s == ' ')
+		++s;
+	return s;
+}
+
 void
 trim(char *s) {
 	char *e;
@@ -1740,23 +4460,40 @@ trim(char *s) {
 	*(e + 1) = '\0';
 }
 
+void
+ttyraw(void) {
+	struct termios ti;
+
+	tcgetattr(0, &origti);
+	ti = origti;
+	cfmakeraw(&ti);
+	ti.c_iflag |= ICRNL;
+	ti.c_cc[VMIN] = 0;
+	ti.c_cc[VTIME] = 0;
+	tcsetattr(0, TCSAFLUSH, &ti);
+}
+
 int
 uiset(char *buf, int index) {
 	int *color, i, len = 0, n;
 	char *p;
 
+	if(!buf) {
+		drawattr = index;
+		return 0;
+	}
 	if(index == -1)
-		return buf ? sprintf(buf, COLRST) : printf(COLRST);
-	color = colors[index];
-	if(!color)
+		return sprintf(buf, COLRST);
+	if(index < 0 || index >= ColorLast)
 		return -1;
+	color = colors[index];
 	for(i = 0; color[i] != -1; ++i) {
 		switch(i) {
 		case 0:  p = COLFG; break;
 		case 1:  p = COLBG; break;
 		default: p = ATTR;  break;
 		}
-		n = buf ? sprintf(&buf[len], p, color[i]) : printf(p, color[i]);
+		n = sprintf(&buf[len], p, color[i]);
 		if(n < 0)
 			return -1;
 		len += n;
@@ -1766,7 +4503,96 @@ uiset(char *buf, int index) {
 
 void
 usage(void) {
-	die("Usage: %s [-v] [-hpnl <arg>]", argv0);
+	die("Usage: %s [-adv] [-hpnl <arg>]\n"
+	    "       %s [-l <arg>] -q [buf=<buffer>] [nick=<nick>] [from=<time>] [to=<time>]", argv0, argv0);
+}
+
+/* Return the user called name, interning it if needed. */
+User *
+useradd(Network *n, char *name) {
+	User *u, *t, **tab;
+	int i, h, sz;
+
+	if((u = userget(n, name)))
+		return u;
+	u = ecalloc(1, sizeof(User));
+	u->id = n->userid++;
+	u->len = strlen(name);
+	u->name = ecalloc(1, u->len + 1);
+	memcpy(u->name, name, u->len);
+	if(++n->nusers > n->usertabsz) {
+		sz = n->usertabsz ? n->usertabsz * 2 : 256;
+		tab = ecalloc(sz, sizeof(User *));
+		for(i = 0; i < n->usertabsz; ++i) {
+			while((t = n->usertab[i])) {
+				n->usertab[i] = t->hnext;
+				h = casehash(n, t->name) & (sz - 1);
+				t->hnext = tab[h];
+				tab[h] = t;
+			}
+		}
+		free(n->usertab);
+		n->usertab = tab;
+		n->usertabsz = sz;
+	}
+	i = casehash(n, u->name) & (n->usertabsz - 1);
+	u->hnext = n->usertab[i];
+	n->usertab[i] = u;
+	return u;
+}
+
+void
+userdel(Network *n, User *u) {
+	User **tu;
+
+	for(tu = &n->usertab[casehash(n, u->name) & (n->usertabsz - 1)]; *tu && *tu != u; tu = &(*tu)->hnext);
+	if(*tu)
+		*tu = u->hnext;
+	--n->nusers;
+	free(u->name);
+	free(u);
+}
+
+User *
+userget(Network *n, char *name) {
+	User *u;
+
+	if(!n->usertabsz)
+		return NULL;
+	for(u = n->usertab[casehash(n, name) & (n->usertabsz - 1)]; u; u = u->hnext)
+		if(!casecmp(n, u->name, name))
+			return u;
+	return NULL;
+}
+
+void
+usermv(Network *n, User *u, char *name) {
+	User **tu;
+	int i;
+
+	for(tu = &n->usertab[casehash(n, u->name) & (n->usertabsz - 1)]; *tu && *tu != u; tu = &(*tu)->hnext);
+	if(*tu)
+		*tu = u->hnext;
+	free(u->name);
+	u->len = strlen(name);
+	u->name = ecalloc(1, u->len + 1);
+	memcpy(u->name, name, u->len);
+	i = casehash(n, u->name) & (n->usertabsz - 1);
+	u->hnext = n->usertab[i];
+	n->usertab[i] = u;
+}
+
+/* Let the frontend go, the screen is only drawn again when one attaches. */
+void
+usrdrop(void) {
+	int fd = usrwatch.fd;
+
+	if(fd < 0)
+		return;
+	watch(&usrwatch, -1, 0);
+	close(fd);
+	outfd = -1;
+	outlen = 0;
 }
 
 void
@@ -1794,6 +4620,11 @@ usrin(void) {
 	for(i = 1; i < nb; ++i) {
 		key = readchar();
 		if(key == EOF) {
+			/* a frontend gone mid-glyph would never send the rest */
+			if(daemonize) {
+				usrdrop();
+				return;
+			}
 			/* TODO: preserve the state and return */
 			while((key = readchar()) == EOF);
 		}
@@ -1819,6 +4650,69 @@ usrin(void) {
 	sel->need_redraw |= REDRAW_CMDLN;
 }
 
+void
+usrio(Watch *w, int events) {
+	if(daemonize && events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+		usrdrop();
+		return;
+	}
+	usrin();
+	drawframe(NULL); /* echo what is typed right away */
+}
+
+/* Decode the glyph at s, invalid sequences decode to U+FFFD. Return the
+ * number of bytes read. */
+int
+utf8decode(char *s, unsigned int *cp) {
+	unsigned char *p = (unsigned char *)s;
+	int nb, i;
+
+	if(*p < 0x80) {
+		*cp = *p;
+		return 1;
+	}
+	nb = UTF8BYTES(*p);
+	if(nb == 1 || *p >= 0xF8) {
+		*cp = 0xFFFD;
+		return 1;
+	}
+	*cp = *p & (0x7F >> nb);
+	for(i = 1; i < nb; ++i) {
+		if(!UTF8CBYTE(p[i])) {
+			*cp = 0xFFFD;
+			return i;
+		}
+		*cp = (*cp << 6) | (p[i] & 0x3F);
+	}
+	return nb;
+}
+
+unsigned int
+vhash(char *s, unsigned int seed) {
+	unsigned int h = 2166136261u ^ seed;
+
+	while(*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % LENGTH(verbs);
+}
+
+/* Have w->func() called on the events of fd. A fd of -1 stops watching. */
+void
+watch(Watch *w, int fd, int events) {
+	struct epoll_event ev;
+
+	if(w->fd == fd && w->events == events)
+		return;
+	ev.events = events;
+	ev.data.ptr = w;
+	if(fd < 0)
+		epoll_ctl(pollfd, EPOLL_CTL_DEL, w->fd, &ev);
+	else if(epoll_ctl(pollfd, w->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+		die("epoll_ctl():");
+	w->fd = fd;
+	w->events = events;
+}
+
 char *
 wordleft(char *str, int offset, int *size) {
 	char *s = &str[offset], *e;
@@ -1839,27 +4733,44 @@ wordleft(char *str, int offset, int *size) {
 int
 main(int argc, char *argv[]) {
 	const char *user = getenv("USER");
+	int attachonly = 0, query = 0;
 
 	ARGBEGIN {
+	case 'a': attachonly = 1; break;
+	case 'd': daemonize = 1; break;
 	case 'h': strncpy(host, EARGF(usage()), sizeof host); break;
 	case 'p': strncpy(port, EARGF(usage()), sizeof port); break;
 	case 'n': strncpy(nick, EARGF(usage()), sizeof nick); break;
-	case 'l': strncpy(logfile, EARGF(usage()), sizeof logfile); break;
+	case 'q': query = 1; break;
+	case 'l': strncpy(logdir, EARGF(usage()), sizeof logdir - 1); break;
 	case 'v': die("circo-"VERSION);
 	default: usage();
 	} ARGEND;
 
+	if(query) {
+		arcquery(argc, argv);
+		return 0;
+	}
+	if(argc)
+		usage();
+	if(attachonly || daemonize)
+		sockfind();
+	if(attachonly) {
+		frontend();
+		return 0;
+	}
 	if(!*nick)
 		strncpy(nick, user ? user : "circo", sizeof nick);
 	setup();
-	if(*logfile)
-		logp = fopen(logfile, "a");
-	setbuf(stdout, NULL);
-	sel = status = newbuf("status");
-	printf(CLEAR);
+	if(daemonize && daemon(1, 0) < 0)
+		die("daemon():");
+	logopen();
+	sel = newnet(host, port)->status;
+	if(daemonize)
+		dial(sel->net); /* nobody is there to /connect */
 	draw();
 	run();
-	mvprintf(1, rows, "\n");
+	printf(COLRST CURPOS "\n", rows, 1);
 	cleanup();
 	return 0;
 }
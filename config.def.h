@@ -4,11 +4,52 @@
 char host[32] = "irc.libera.chat";
 char port[8] = "6667";
 char nick[32] = {0}; /* 0 means getenv("USER") */
-char logfile[64] = "/tmp/circo.log";
+char logdir[64] = "/tmp/circo-log"; /* "" to disable */
 
 /* passed to strftime(3) */
 static char prefix_format[] = "%T | ";
 
+/* maximum number of frames drawn per second, typing is always drawn at once */
+static unsigned int maxfps = 60;
+
+/* scrollback bytes of all the buffers: past scrollmem the old text of the
+ * buffers in background gets compressed, past scrollmax it gets dropped */
+static unsigned long scrollmem = 32UL << 20;
+static unsigned long scrollmax = 64UL << 20;
+
+/* scrollback store, one file per server and buffer, "" to disable */
+static char storedir[] = "/tmp/circo";
+
+/* lines of the store shown in new buffers */
+static unsigned int storelines = 500;
+
+/* command history of each buffer, in entries and in bytes */
+static unsigned int histmax = 1000;
+static unsigned int histbytes = 32768;
+
+/* flood control: at most sendburst lines are sent at once, then one every
+ * sendms milliseconds */
+static unsigned int sendburst = 5;
+static unsigned int sendms = 2000;
+
+/* when the connection is lost, connect again after reconnectmin seconds,
+ * doubling the wait up to reconnectmax after each failure, 0 to disable */
+static unsigned int reconnectmin = 5;
+static unsigned int reconnectmax = 300;
+
+/* event logs, one file per server and buffer in logdir: a file is rotated
+ * once it is logsize bytes or logage seconds old, 0 to disable the latter,
+ * and moved in the archive which circo -q searches.
+ * Past logqueue bytes, a power of two, waiting to be written, lines are
+ * dropped rather than waited for. */
+static unsigned long logsize = 16UL << 20;
+static unsigned int logage = 86400;
+static unsigned int logqueue = 1 << 20;
+
+/* where frontends attach to circo -d, see circo -a: in $XDG_RUNTIME_DIR,
+ * or else in /tmp/circo-$UID */
+static char sockname[] = "circo.sock";
+
 /* Used if no message is specified */
 #define QUIT_MESSAGE "circo"
 
@@ -27,11 +68,15 @@ static Command commands[] = {
 	/* command     function */
 	{ "close",     cmd_close },
 	{ "connect",   cmd_server },
+	{ "detach",    cmd_detach },
+	{ "mem",       cmd_mem },
 	{ "msg",       cmd_msg },
+	{ "network",   cmd_network },
 	{ "quit",      cmd_quit },
 	{ "server",    cmd_server },
 	{ "topic",     cmd_topic },
 	{ "rejoinall", cmd_rejoinall },
+	{ "stats",     cmd_stats },
 };
 
 /* key definitions */
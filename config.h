@@ -0,0 +1,104 @@
+/* See LICENSE file for copyright and license details. */
+
+/* defaults */
+char host[32] = "irc.libera.chat";
+char port[8] = "6667";
+char nick[32] = {0}; /* 0 means getenv("USER") */
+char logdir[64] = "/tmp/circo-log"; /* "" to disable */
+
+/* passed to strftime(3) */
+static char prefix_format[] = "%T | ";
+
+/* maximum number of frames drawn per second, typing is always drawn at once */
+static unsigned int maxfps = 60;
+
+/* scrollback bytes of all the buffers: past scrollmem the old text of the
+ * buffers in background gets compressed, past scrollmax it gets dropped */
+static unsigned long scrollmem = 32UL << 20;
+static unsigned long scrollmax = 64UL << 20;
+
+/* scrollback store, one file per server and buffer, "" to disable */
+static char storedir[] = "/tmp/circo";
+
+/* lines of the store shown in new buffers */
+static unsigned int storelines = 500;
+
+/* command history of each buffer, in entries and in bytes */
+static unsigned int histmax = 1000;
+static unsigned int histbytes = 32768;
+
+/* flood control: at most sendburst lines are sent at once, then one every
+ * sendms milliseconds */
+static unsigned int sendburst = 5;
+static unsigned int sendms = 2000;
+
+/* when the connection is lost, connect again after reconnectmin seconds,
+ * doubling the wait up to reconnectmax after each failure, 0 to disable */
+static unsigned int reconnectmin = 5;
+static unsigned int reconnectmax = 300;
+
+/* event logs, one file per server and buffer in logdir: a file is rotated
+ * once it is logsize bytes or logage seconds old, 0 to disable the latter,
+ * and moved in the archive which circo -q searches.
+ * Past logqueue bytes, a power of two, waiting to be written, lines are
+ * dropped rather than waited for. */
+static unsigned long logsize = 16UL << 20;
+static unsigned int logage = 86400;
+static unsigned int logqueue = 1 << 20;
+
+/* where frontends attach to circo -d, see circo -a: in $XDG_RUNTIME_DIR,
+ * or else in /tmp/circo-$UID */
+static char sockname[] = "circo.sock";
+
+/* Used if no message is specified */
+#define QUIT_MESSAGE "circo"
+
+/* Called for background mentions */
+#define NOTIFY_SCRIPT ""
+
+/* color scheme */
+static int colors[ColorLast][5] = {
+	[NickNormal] = {4, -1},
+	[NickMention] = {5, 0, 1, -1},
+	[IRCMessage] = {8, 0, -1},
+};
+
+/* available commands */
+static Command commands[] = {
+	/* command     function */
+	{ "close",     cmd_close },
+	{ "connect",   cmd_server },
+	{ "detach",    cmd_detach },
+	{ "mem",       cmd_mem },
+	{ "msg",       cmd_msg },
+	{ "network",   cmd_network },
+	{ "quit",      cmd_quit },
+	{ "server",    cmd_server },
+	{ "topic",     cmd_topic },
+	{ "rejoinall", cmd_rejoinall },
+	{ "stats",     cmd_stats },
+};
+
+/* key definitions */
+static Key keys[] = {
+	/* key            function          argument */
+        { CTRL('u'),      cmdln_clear,      {0} },
+        { KeyBackspace,   cmdln_chldel,     {0} },
+        { CTRL('d'),      cmdln_chrdel,     {0} },
+        { '\t',           cmdln_complete,   {0} },
+        { CTRL('a'),      cmdln_cursor,     {.i = 0}},
+        { CTRL('e'),      cmdln_cursor,     {.i = 999}},
+        { CTRL('h'),      cmdln_cursor,     {.i = -1}},
+        { KeyLeft,        cmdln_cursor,     {.i = -1}},
+        { CTRL('l'),      cmdln_cursor,     {.i = +1}},
+        { KeyRight,       cmdln_cursor,     {.i = +1}},
+        { '\n',           cmdln_submit,     {0} },
+        { CTRL('w'),      cmdln_wdel,       {0} },
+        { CTRL('n'),      focusnext,        {0} },
+        { CTRL('p'),      focusprev,        {0} },
+        { KeyPgUp,        scroll,           {.i = -20} },
+        { KeyPgDw,        scroll,           {.i = +20} },
+        { KeyEnd,         scroll,           {.i = 0} },
+        { KeyUp,          history,          {.i = -1} },
+        { KeyDown,        history,          {.i = +1} },
+};
@@ -11,6 +11,7 @@ MANPREFIX = ${PREFIX}/share/man
 CPPFLAGS = -D_DEFAULT_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\"
 #CFLAGS   = -std=c99 -g -pedantic -Wall -O0 ${CPPFLAGS} -DDEBUG
 CFLAGS  = -std=c99 -pedantic -Wall -Wno-deprecated-declarations -Os ${CPPFLAGS}
+LDFLAGS = -pthread
 
 # compiler and linker
 CC = cc